@@ -0,0 +1,388 @@
+// Microbenchmarks de las funciones del manager que están en el camino de cada mensaje. Se compila junto
+// con manager.c (sin su main) y usa el modo de reproducción como transporte en memoria: las entregas
+// se descartan como si se hubieran escrito, no se abren pipes y no se envían señales. manager_bench usa
+// los límites del manager; manager_bench_wide usa pocos tópicos y 10000 suscriptores por tópico para los
+// casos que no caben en ellos
+#define MANAGER_NO_MAIN
+#include "manager.c"
+#include <linux/perf_event.h>
+
+#define BENCH_MIN_NS 200000000ULL // Tiempo mínimo de medida de cada caso
+#define BENCH_BATCH 64 // Operaciones entre dos comprobaciones del tiempo medido
+#define BENCH_WIDE_SUBS 10000 // Suscriptores del caso de escalado del reparto con los hilos
+
+// Struct de la medida de un caso: se acumula entre varios tramos medidos
+typedef struct {
+    unsigned long long ns; // Tiempo medido
+    unsigned long allocs; // Llamadas a malloc, calloc y realloc
+    unsigned long long misses; // Fallos de caché (si perf_event_open está disponible)
+    unsigned long ops; // Operaciones medidas
+    struct timespec start; // Inicio del tramo en curso
+    unsigned long start_allocs;
+    unsigned long long start_misses;
+} Measure;
+
+unsigned long bench_allocs = 0; // Asignaciones de memoria del programa (el enlazado con --wrap las redirige aquí)
+int cache_fd = -1; // Contador de fallos de caché de perf_event_open (-1 si no está disponible)
+FILE *report = NULL; // Salida del informe (la salida estándar se descarta: el manager imprime en cada comando)
+const char *bench_filter = NULL; // Solo se ejecutan los casos cuyo nombre contiene este texto
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+// Funciones que sustituyen a malloc, calloc y realloc para contar las asignaciones
+void *__wrap_malloc(size_t size) {
+    bench_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    bench_allocs++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    bench_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+// Función para abrir el contador de fallos de caché del proceso, devuelve -1 si no está disponible
+int open_cache_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Función para leer el contador de fallos de caché (0 si no está disponible)
+unsigned long long read_cache_misses() {
+    unsigned long long value = 0;
+    if (cache_fd != -1 && read(cache_fd, &value, sizeof(value)) != sizeof(value)) {
+        value = 0;
+    }
+    return value;
+}
+
+// Función para empezar un tramo medido
+void measure_begin(Measure *m) {
+    m->start_allocs = bench_allocs;
+    m->start_misses = read_cache_misses();
+    clock_gettime(CLOCK_MONOTONIC, &m->start);
+}
+
+// Función para terminar un tramo medido de ops operaciones
+void measure_end(Measure *m, unsigned long ops) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    m->ns += (end.tv_sec - m->start.tv_sec) * 1000000000ULL + (end.tv_nsec - m->start.tv_nsec);
+    m->misses += read_cache_misses() - m->start_misses;
+    m->allocs += bench_allocs - m->start_allocs;
+    m->ops += ops;
+}
+
+// Función para imprimir el resultado de un caso
+void measure_report(const char *name, const char *params, const Measure *m) {
+    double ops = m->ops > 0 ? m->ops : 1;
+    char misses[32] = "n/d";
+    if (cache_fd != -1) {
+        snprintf(misses, sizeof(misses), "%.1f", m->misses / ops);
+    }
+    fprintf(report, "%-9s %-30s %12.1f ns/op %8.2f asig/op %10s fallos/op  (%lu ops)\n",
+            name, params, m->ns / ops, m->allocs / ops, misses, m->ops);
+    fflush(report);
+}
+
+// Función para comprobar si un caso pasa el filtro de la línea de comandos
+int bench_selected(const char *name) {
+    return bench_filter == NULL || strstr(name, bench_filter) != NULL;
+}
+
+// Función para descartar los registros que el manager envía al hilo de persistencia
+void drain_persist() {
+    PersistRecord *record;
+    while ((record = persist_queue_pop(&persist_queue)) != NULL) {
+        free(record->data);
+        free(record);
+    }
+}
+
+// Función para comprobar si caben en los límites de este binario un caso con users clientes y subscribers
+// suscriptores en un tópico. Si no caben se indica que lo mide manager_bench_wide
+int bench_fits(const char *name, const char *params, int users, int subscribers) {
+    if (users <= MAX_USERS && subscribers <= MAX_SUBSCRIBERS) {
+        return 1;
+    }
+    fprintf(report, "%-9s %-30s requiere manager_bench_wide (más suscriptores por tópico)\n", name, params);
+    return 0;
+}
+
+// Función para vaciar las bandejas de los clientes (las escrituras se descartan)
+void drain_deliveries() {
+    flush_all_clients(FLUSH_IDLE);
+}
+
+// Función para volver al estado inicial: sin clientes, sin tópicos y sin mensajes retenidos
+void bench_reset() {
+    while (client_count > 0) {
+        drop_client(client_count - 1);
+    }
+    for (int i = 0; i < message_count; i++) {
+        messages[i]->lifetime = 0;
+    }
+    compact_messages();
+    topic_count = 0;
+    drain_persist();
+}
+
+// Función para conectar un cliente falso, devuelve su índice
+int bench_client(const char *username) {
+    char pipe_name[64];
+    snprintf(pipe_name, sizeof(pipe_name), "bench_pipe_%s", username);
+    add_client(pipe_name, username, getpid(), 0);
+    return find_client(username);
+}
+
+// Función para preparar una publicación de un cliente en un tópico
+void bench_request(Response *request, int sender, const char *topic, int lifetime, int size) {
+    memset(request, 0, sizeof(*request));
+    strncpy(request->client_pipe, clients[sender].client_pipe, sizeof(request->client_pipe) - 1);
+    strncpy(request->username, clients[sender].username, sizeof(request->username) - 1);
+    strncpy(request->topic, topic, sizeof(request->topic) - 1);
+    request->command_type = 5;
+    request->lifetime = lifetime;
+    memset(request->message, 'x', size);
+}
+
+// Función para publicar retained mensajes persistentes en cada uno de topics tópicos
+void bench_retain(int topics_wanted, int retained, int lifetime) {
+    int sender = find_client("pub");
+    if (sender == -1) {
+        sender = bench_client("pub");
+    }
+    Response request;
+    char topic[TOPIC_NAME_LEN];
+    for (int t = 0; t < topics_wanted; t++) {
+        snprintf(topic, sizeof(topic), "ret%d", t);
+        bench_request(&request, sender, topic, lifetime, 32);
+        for (int r = 0; r < retained; r++) {
+            send_message(&request, find_client("pub"));
+        }
+    }
+    drain_deliveries();
+    drain_persist();
+}
+
+// Caso: búsqueda de un tópico por nombre entre count tópicos
+void bench_lookup(int count) {
+    char params[64];
+    snprintf(params, sizeof(params), "topics=%d", count);
+    bench_reset();
+    static char names[MAX_TOPICS][TOPIC_NAME_LEN];
+    for (int t = 0; t < count; t++) {
+        snprintf(names[t], TOPIC_NAME_LEN, "topic%d", t);
+        create_topic(names[t]);
+    }
+    Measure m = { 0 };
+    volatile int sink = 0;
+    unsigned long i = 0;
+    while (m.ns < BENCH_MIN_NS) {
+        measure_begin(&m);
+        for (int b = 0; b < BENCH_BATCH; b++, i++) {
+            sink += find_topic(names[(i * 7919) % count]); // orden no secuencial
+        }
+        measure_end(&m, BENCH_BATCH);
+    }
+    measure_report("lookup", params, &m);
+}
+
+// Caso: publicación no persistente en un tópico con subscribers suscriptores, incluido el vaciado de las
+// bandejas, repartida entre el hilo que publica y threads hilos de reparto
+void bench_fanout(int subscribers, int size, int threads) {
+    char params[64];
+    snprintf(params, sizeof(params), "subs=%d size=%d hilos=%d", subscribers, size, threads);
+    if (!bench_fits("fanout", params, subscribers + 1, subscribers)) {
+        return;
+    }
+    bench_reset();
+    fanout_threads = threads;
+    start_fanout_workers();
+    int sender = bench_client("pub");
+    char name[32];
+    for (int s = 0; s < subscribers; s++) {
+        snprintf(name, sizeof(name), "s%d", s);
+        int k = bench_client(name);
+        subscribe_topic("t", clients[k].client_pipe, name, "", 0);
+    }
+    drain_deliveries();
+    Response request;
+    bench_request(&request, sender, "t", 0, size);
+    Measure m = { 0 };
+    while (m.ns < BENCH_MIN_NS) {
+        measure_begin(&m);
+        for (int b = 0; b < BENCH_BATCH; b++) {
+            send_message(&request, sender);
+            drain_deliveries();
+        }
+        measure_end(&m, BENCH_BATCH);
+    }
+    stop_fanout_workers();
+    measure_report("fanout", params, &m);
+}
+
+// Caso: suscripción a un tópico con retained mensajes persistentes y others suscriptores (más la baja)
+void bench_replay(int retained, int others) {
+    char params[64];
+    snprintf(params, sizeof(params), "retained=%d subs=%d", retained, others);
+    if (!bench_fits("replay", params, others + 2, others + 1)) {
+        return;
+    }
+    bench_reset();
+    char name[32];
+    for (int s = 0; s < others; s++) {
+        snprintf(name, sizeof(name), "s%d", s);
+        int k = bench_client(name);
+        subscribe_topic("ret0", clients[k].client_pipe, name, "", 0);
+    }
+    bench_retain(1, retained, 1000000);
+    int k = bench_client("nuevo");
+    Measure m = { 0 };
+    while (m.ns < BENCH_MIN_NS) {
+        measure_begin(&m);
+        for (int b = 0; b < BENCH_BATCH; b++) {
+            subscribe_topic("ret0", clients[k].client_pipe, "nuevo", "", 0);
+            unsubscribe_topic("ret0", clients[k].client_pipe, "nuevo");
+            drain_deliveries();
+        }
+        measure_end(&m, BENCH_BATCH);
+    }
+    measure_report("replay", params, &m);
+}
+
+// Caso: pasada del lifetime con count mensajes retenidos que caducan o no en esa pasada
+void bench_expiry(int count, int expiring) {
+    char params[64];
+    snprintf(params, sizeof(params), "retained=%d %s", count, expiring ? "caducan" : "siguen");
+    bench_reset();
+    bench_client("pub");
+    int lifetime = expiring ? 1 : 1000000000;
+    bench_retain(count / 5, 5, lifetime);
+    Measure m = { 0 };
+    while (m.ns < BENCH_MIN_NS) {
+        if (expiring && message_count == 0) {
+            bench_retain(count / 5, 5, lifetime); // fuera de la medida
+        }
+        measure_begin(&m);
+        lifetime_tick();
+        measure_end(&m, 1);
+        drain_persist();
+    }
+    measure_report("expiry", params, &m);
+}
+
+// Caso: carga de un archivo de mensajes con count líneas
+void bench_load(int count) {
+    char params[64];
+    snprintf(params, sizeof(params), "lines=%d", count);
+    bench_reset();
+    char path[] = "/tmp/bench_mensajesXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("Error al crear el archivo de mensajes del benchmark");
+        return;
+    }
+    FILE *file = fdopen(fd, "w");
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "topic%d user%d %d mensaje número %d con algo de texto\n", i / 5, i % 7, 1000 + i, i);
+    }
+    fclose(file);
+    setenv("MSG_FICH", path, 1);
+
+    Measure m = { 0 };
+    while (m.ns < BENCH_MIN_NS) {
+        measure_begin(&m);
+        load_messages();
+        measure_end(&m, 1);
+        bench_reset(); // fuera de la medida
+    }
+    unlink(path);
+    measure_report("load", params, &m);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        fprintf(stderr, "Uso: %s [caso]\n", argv[0]);
+        return 1;
+    }
+    bench_filter = argc == 2 ? argv[1] : NULL;
+
+    // El informe va a la salida original; lo que imprime el manager se descarta
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("Error al preparar la salida del benchmark");
+        return 1;
+    }
+
+    replay_mode = 1; // transporte en memoria
+    fanout_threads = 0; // cada caso de reparto arranca sus propios hilos
+    init_names();
+    init_sessions();
+    sem_init(&persist_sem, 0, 0); // persist_enqueue avisa al hilo de persistencia aunque aquí no se arranque
+    index_clients();
+    persist_queue_init(&persist_queue);
+    pthread_mutex_init(&mutex, NULL);
+    cache_fd = open_cache_counter();
+
+    fprintf(report, "Microbenchmarks del manager (transporte en memoria, fallos de caché: %s)\n",
+            cache_fd != -1 ? "perf_event_open" : "no disponibles");
+    fprintf(report, "Límites: %d tópicos, %d clientes, %d suscriptores por tópico\n", MAX_TOPICS, MAX_USERS, MAX_SUBSCRIBERS);
+    if (bench_selected("lookup")) {
+        int counts[] = { 5, 10, 20 };
+        for (int i = 0; i < 3 && counts[i] <= MAX_TOPICS; i++) {
+            bench_lookup(counts[i]);
+        }
+    }
+    if (bench_selected("fanout")) {
+        int subs[] = { 1, 64, 1024 };
+        int sizes[] = { 16, 256 };
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 2; j++) {
+                bench_fanout(subs[i], sizes[j], 0); // el reparto en el hilo que publica, para medir siempre lo mismo
+            }
+        }
+
+        // Escalado de un tópico muy ancho con los núcleos: de 0 hilos de reparto a uno menos que los núcleos
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int threads = 0; threads < cores && threads <= MAX_FANOUT_THREADS; threads++) {
+            bench_fanout(BENCH_WIDE_SUBS, 256, threads);
+        }
+    }
+    if (bench_selected("replay")) {
+        int retained[] = { 0, 5 };
+        int subs[] = { 0, 256 };
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 2; j++) {
+                bench_replay(retained[i], subs[j]);
+            }
+        }
+    }
+    if (bench_selected("expiry")) {
+        int counts[] = { 20, 100 };
+        for (int i = 0; i < 2 && counts[i] / 5 <= MAX_TOPICS; i++) {
+            bench_expiry(counts[i], 0);
+            bench_expiry(counts[i], 1);
+        }
+    }
+    if (bench_selected("load")) {
+        int counts[] = { 10, 100 };
+        for (int i = 0; i < 2 && counts[i] / 5 <= MAX_TOPICS; i++) {
+            bench_load(counts[i]);
+        }
+    }
+    bench_reset();
+    return 0;
+}
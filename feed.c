@@ -1,4 +1,11 @@
 #include "util.h"
+#include <sys/uio.h>
+#include <errno.h>
+#include <limits.h>
+
+#define RING_SIZE 65536 // Tamaño del buffer circular de recepción (potencia de 2)
+#define RING_MASK (RING_SIZE - 1)
+#define MAX_IOV 64 // Máximo de segmentos por llamada a writev
 
 // Struct de comunicación con el manager
 typedef struct {
@@ -9,13 +16,70 @@ typedef struct {
     pid_t pid;
     int lifetime;
     char message[TAM_MSG];
+    uint32_t session; // Identificador de sesión que asigna cada shard al conectarse (0 = sin sesión)
+    char key[KEY_LEN]; // Clave del mensaje para los tópicos compactados (vacía si no tiene)
+    uint32_t dictionary; // Diccionario del tópico que ya se tiene al suscribirse (0 = ninguno)
 } Request;
 
+// Buffer circular para recibir los mensajes del manager
+typedef struct {
+    char data[RING_SIZE]; // Datos recibidos
+    size_t head; // Posición de lectura (inicio del primer mensaje sin procesar)
+    size_t scan; // Posición hasta la que ya se buscó el caracter nulo
+    size_t tail; // Posición de escritura (fin de los datos recibidos)
+} RingBuffer;
+
+// Diccionario recibido de un tópico comprimido, se conserva para las siguientes suscripciones
+typedef struct {
+    char topic[TOPIC_NAME_LEN];
+    uint32_t id; // Identificador del diccionario en el manager
+    int len;
+    char data[LZ_DICT_SIZE];
+} Dictionary;
+
+// Segmentos pendientes de escribir en la salida estándar
+typedef struct {
+    struct iovec iov[MAX_IOV];
+    int count;
+} OutputBatch;
+
 Request msg;
+RingBuffer rings[MAX_SHARDS]; // Un buffer de recepción por shard: cada manager escribe en su propia pipe
+int shard_count = 1; // Número de managers del modo repartido
+ShardRing shard_ring; // Reparto de los tópicos entre los shards
+char client_pipes[MAX_SHARDS][256]; // Pipe por la que responde cada shard
+uint32_t sessions[MAX_SHARDS]; // Identificador de sesión en cada shard (0 hasta recibirlo)
+int quiet_mode = 0; // Modo silencioso: solo cuenta los mensajes recibidos
+unsigned long received_messages = 0; // Mensajes completos recibidos
+unsigned long received_bytes = 0; // Bytes de mensajes recibidos
+unsigned long write_calls = 0; // Llamadas a writev realizadas
+int accepts_compressed = 0; // Pide al manager los mensajes retenidos comprimidos
+Dictionary dictionaries[MAX_TOPICS]; // Diccionarios de los tópicos comprimidos recibidos
+int dictionary_count = 0;
+unsigned long compressed_frames = 0; // Reenvíos comprimidos recibidos
+unsigned long decompressed_bytes = 0; // Bytes de esos reenvíos una vez descomprimidos
+char frame_copy[RING_SIZE]; // Mensaje comprimido copiado de forma contigua desde el buffer circular
+char decompressed[LZ_RAW_MAX]; // Último reenvío descomprimido
+
+// Función para mostrar las estadísticas de recepción del modo silencioso
+void print_receive_stats() {
+    if (quiet_mode) {
+        printf("Recibidos %lu mensajes (%lu bytes), %lu escrituras en la salida.\n",
+               received_messages, received_bytes, write_calls);
+        if (compressed_frames > 0) {
+            printf("Reenvíos comprimidos: %lu (%lu bytes descomprimidos).\n", compressed_frames, decompressed_bytes);
+        }
+    }
+}
 
-// Función para enviar un comando al servidor
-void send_command_to_server(Request *msg) {
-    int fd = open(SERVER_PIPE, O_WRONLY);
+// Función para enviar un comando a un shard, indicando la pipe por la que debe responder
+void send_command_to_shard(Request *msg, int shard) {
+    char server_pipe[64];
+    server_pipe_name(server_pipe, sizeof(server_pipe), shard, shard_count);
+    snprintf(msg->client_pipe, sizeof(msg->client_pipe), "%s", client_pipes[shard]);
+    msg->session = sessions[shard];
+
+    int fd = open(server_pipe, O_WRONLY);
     if (fd == -1) {
         perror("Error al abrir la pipe del servidor");
         exit(EXIT_FAILURE);
@@ -24,19 +88,51 @@ void send_command_to_server(Request *msg) {
     close(fd);
 }
 
+// Función para comprobar si ya se recibió el identificador de sesión de todos los shards
+int sessions_ready() {
+    for (int shard = 0; shard < shard_count; shard++) {
+        if (sessions[shard] == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Función para enviar un comando al servidor: los comandos de un tópico van al shard dueño,
+// el resto (inicio de sesión, salida, listado) a todos
+void send_command_to_server(Request *msg) {
+    int topic_command = msg->command_type == 1 || msg->command_type == 4 || msg->command_type == 5 || msg->command_type == 7;
+    if (topic_command) {
+        send_command_to_shard(msg, shard_of(&shard_ring, msg->topic));
+        return;
+    }
+    for (int shard = 0; shard < shard_count; shard++) {
+        send_command_to_shard(msg, shard);
+    }
+}
+
+// Función para borrar las pipes del cliente
+void remove_client_pipes() {
+    for (int shard = 0; shard < shard_count; shard++) {
+        unlink(client_pipes[shard]);
+    }
+}
+
 // Función para manejar la señal SIGINT (CTRL+C del cliente)
 void handle_sigint(int sig) {
     printf("\nSe recibió la señal SIGINT. Limpiando recursos...\n");
+    print_receive_stats();
     msg.command_type = 6;
     send_command_to_server(&msg);
-    unlink(msg.client_pipe);
+    remove_client_pipes();
     exit(0);
 }
 
 // Función para manejar la señal SIGTERM (close, remove y CTRL+C del manager)
 void handle_sigterm(int sig) {
     printf("\nSe recibió la señal SIGTERM. Cerrando el cliente...\n");
-    unlink(msg.client_pipe);
+    print_receive_stats();
+    remove_client_pipes();
     exit(0);
 }
 
@@ -61,15 +157,275 @@ void setup_signal_handlers() {
     }
 }
 
+// Función para escribir en la salida estándar todos los segmentos acumulados con una sola llamada
+void flush_output(OutputBatch *batch) {
+    struct iovec *iov = batch->iov;
+    int count = batch->count;
+
+    fflush(stdout); // respetar el orden con lo escrito mediante printf
+    while (count > 0) {
+        ssize_t written = writev(STDOUT_FILENO, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error al escribir en la salida estándar");
+            break;
+        }
+        write_calls++;
+
+        // Saltar los segmentos ya escritos por completo (escritura parcial)
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    batch->count = 0;
+}
+
+// Función para añadir un segmento al lote de salida
+void add_segment(OutputBatch *batch, const void *base, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (batch->count == MAX_IOV) {
+        flush_output(batch);
+    }
+    batch->iov[batch->count].iov_base = (void *)base;
+    batch->iov[batch->count].iov_len = len;
+    batch->count++;
+}
+
+// Función para buscar el diccionario recibido de un tópico, devuelve NULL si no se tiene
+Dictionary *find_dictionary(const char *topic) {
+    for (int i = 0; i < dictionary_count; i++) {
+        if (strcmp(dictionaries[i].topic, topic) == 0) {
+            return &dictionaries[i];
+        }
+    }
+    return NULL;
+}
+
+// Función para guardar el diccionario de un tópico: "LZDICT\t<topic> <id> <diccionario en COBS>"
+void store_dictionary(const char *frame, size_t len) {
+    char topic[TOPIC_NAME_LEN];
+    unsigned id;
+    int consumed = 0;
+    if (sscanf(frame + strlen(LZ_DICT_TAG), "%20s %u%n", topic, &id, &consumed) != 2) {
+        return;
+    }
+    size_t header = strlen(LZ_DICT_TAG) + consumed + 1;
+    Dictionary *dictionary = find_dictionary(topic);
+    if (dictionary == NULL) {
+        if (dictionary_count == MAX_TOPICS) {
+            return;
+        }
+        dictionary = &dictionaries[dictionary_count++];
+        strcpy(dictionary->topic, topic);
+    }
+    long dictionary_len = header <= len ? cobs_decode(frame + header, len - header, dictionary->data, LZ_DICT_SIZE, 0) : -1;
+    dictionary->len = dictionary_len > 0 ? dictionary_len : 0;
+    dictionary->id = dictionary_len > 0 ? id : 0; // dañado: se vuelve a pedir en la siguiente suscripción
+}
+
+// Función para descomprimir un reenvío: "LZ\t<topic> <id> <bytes originales> <datos en COBS>",
+// devuelve la longitud del texto descomprimido o -1 si falta el diccionario o los datos no son válidos
+long decompress_frame(const char *frame, size_t len) {
+    char topic[TOPIC_NAME_LEN];
+    unsigned id;
+    int raw_len, consumed = 0;
+    if (sscanf(frame + strlen(LZ_FRAME_TAG), "%20s %u %d%n", topic, &id, &raw_len, &consumed) != 3 ||
+        raw_len <= 0 || raw_len > LZ_RAW_MAX) {
+        return -1;
+    }
+    size_t header = strlen(LZ_FRAME_TAG) + consumed + 1;
+    Dictionary *dictionary = find_dictionary(topic);
+    if (header > len || (id != 0 && (dictionary == NULL || dictionary->id != id))) {
+        return -1;
+    }
+
+    static char compressed[LZ_FRAME_MAX];
+    long size = cobs_decode(frame + header, len - header, compressed, sizeof(compressed), 0);
+    if (size <= 0) {
+        return -1;
+    }
+    const char *dict = id != 0 ? dictionary->data : "";
+    int dict_len = id != 0 ? dictionary->len : 0;
+    return lz_decompress(dict, dict_len, compressed, size, decompressed, raw_len) == raw_len ? raw_len : -1;
+}
+
+// Función para atender los mensajes comprimidos (diccionarios y reenvíos), devuelve 0 si no lo es
+int emit_compressed(OutputBatch *batch, RingBuffer *ring, size_t start, size_t len) {
+    char tag[8];
+    size_t tag_len = len < sizeof(tag) - 1 ? len : sizeof(tag) - 1;
+    for (size_t i = 0; i < tag_len; i++) {
+        tag[i] = ring->data[(start + i) & RING_MASK];
+    }
+    tag[tag_len] = '\0';
+    int is_dictionary = strncmp(tag, LZ_DICT_TAG, strlen(LZ_DICT_TAG)) == 0;
+    if (!is_dictionary && strncmp(tag, LZ_FRAME_TAG, strlen(LZ_FRAME_TAG)) != 0) {
+        return 0;
+    }
+
+    // Copia contigua del mensaje, que puede estar partido entre el final y el principio del buffer
+    size_t pos = start & RING_MASK;
+    size_t first = len < RING_SIZE - pos ? len : RING_SIZE - pos;
+    memcpy(frame_copy, ring->data + pos, first);
+    memcpy(frame_copy + first, ring->data, len - first);
+    if (is_dictionary) {
+        store_dictionary(frame_copy, len);
+        return 1;
+    }
+
+    received_messages++;
+    received_bytes += len;
+    long raw_len = decompress_frame(frame_copy, len);
+    if (raw_len == -1) {
+        printf("Reenvío comprimido no válido o sin su diccionario: se descarta.\n");
+        return 1;
+    }
+    compressed_frames++;
+    decompressed_bytes += raw_len;
+    if (!quiet_mode) {
+        // El buffer de descompresión se reutiliza en el siguiente reenvío: se escribe ya
+        add_segment(batch, decompressed, raw_len);
+        add_segment(batch, "\n", 1);
+        flush_output(batch);
+    }
+    return 1;
+}
+
+// Función para registrar un mensaje completo del buffer circular (posiciones absolutas [start, end))
+void emit_frame(OutputBatch *batch, RingBuffer *ring, size_t start, size_t end) {
+    size_t len = end - start;
+    if (len == 0) {
+        return; // ignorar mensajes vacíos
+    }
+
+    // Identificador de sesión del shard: se guarda para los siguientes comandos y no se muestra
+    char control[24];
+    if (len < sizeof(control)) {
+        for (size_t i = 0; i < len; i++) {
+            control[i] = ring->data[(start + i) & RING_MASK];
+        }
+        control[len] = '\0';
+        if (strncmp(control, "SESION ", 7) == 0) {
+            sessions[ring - rings] = strtoul(control + 7, NULL, 10);
+            return;
+        }
+    }
+    if (accepts_compressed && emit_compressed(batch, ring, start, len)) {
+        return;
+    }
+    received_messages++;
+    received_bytes += len;
+    if (quiet_mode) {
+        return;
+    }
+
+    // El mensaje puede estar partido entre el final y el principio del buffer
+    size_t pos = start & RING_MASK;
+    size_t first = len < RING_SIZE - pos ? len : RING_SIZE - pos;
+    add_segment(batch, ring->data + pos, first);
+    add_segment(batch, ring->data, len - first);
+    add_segment(batch, "\n", 1);
+}
+
+// Función para leer del pipe del cliente todo lo que quepa en el espacio libre del buffer circular
+ssize_t fill_ring(RingBuffer *ring, int fd) {
+    size_t free_space = RING_SIZE - (ring->tail - ring->head);
+    if (free_space == 0) {
+        return 0;
+    }
+
+    // El espacio libre puede estar dividido en dos tramos
+    size_t pos = ring->tail & RING_MASK;
+    size_t first = free_space < RING_SIZE - pos ? free_space : RING_SIZE - pos;
+    struct iovec iov[2] = {
+        { ring->data + pos, first },
+        { ring->data, free_space - first }
+    };
+
+    ssize_t bytes_read = readv(fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+    if (bytes_read > 0) {
+        ring->tail += bytes_read;
+    } else if (bytes_read < 0 && errno != EAGAIN && errno != EINTR) {
+        perror("Error al leer la pipe del cliente");
+    }
+    return bytes_read;
+}
+
+// Función para separar los mensajes completos (terminados en nulo) y mostrarlos en bloque
+void process_ring(RingBuffer *ring, OutputBatch *batch) {
+    while (ring->scan != ring->tail) {
+        size_t pos = ring->scan & RING_MASK;
+        size_t pending = ring->tail - ring->scan;
+        size_t contiguous = pending < RING_SIZE - pos ? pending : RING_SIZE - pos;
+
+        char *nul = memchr(ring->data + pos, '\0', contiguous);
+        if (nul == NULL) {
+            ring->scan += contiguous; // seguir buscando en el siguiente tramo
+            continue;
+        }
+        size_t end = ring->scan + (nul - (ring->data + pos));
+        emit_frame(batch, ring, ring->head, end);
+        ring->head = ring->scan = end + 1; // saltar el caracter nulo
+    }
+
+    // Si el buffer está lleno sin ningún fin de mensaje, se muestra tal cual para no bloquear la recepción
+    if (ring->tail - ring->head == RING_SIZE) {
+        emit_frame(batch, ring, ring->head, ring->tail);
+        ring->head = ring->scan = ring->tail;
+    }
+
+    flush_output(batch);
+}
+
 // Función para procesar los comandos del usuario
 void handle_user_input() {
     char input[512];
-    fgets(input, sizeof(input), stdin);
+    if (fgets(input, sizeof(input), stdin) == NULL) {
+        strcpy(input, "exit"); // fin de la entrada: salir en vez de repetir el último comando
+    }
     input[strcspn(input, "\n")] = 0;
 
     if (strncmp(input, "subscribe ", 10) == 0) {
-        msg.command_type = 1;
-        strncpy(msg.topic, input + 10, sizeof(msg.topic));
+        char topic[50], keyword[8], group[GROUP_NAME_LEN], policy[8] = "rr";
+        int args = sscanf(input + 10, "%49s %7s %20s %7s", topic, keyword, group, policy);
+
+        if (args >= 3 && strcmp(keyword, "group") == 0) {
+            // subscribe <topic> group <nombre> [rr|lqd]
+            if (strcmp(policy, "rr") != 0 && strcmp(policy, "lqd") != 0) {
+                printf("Política de reparto no válida (rr o lqd).\n");
+                return;
+            }
+            msg.command_type = 7;
+            strncpy(msg.topic, topic, sizeof(msg.topic));
+            snprintf(msg.message, sizeof(msg.message), "%s %s", group, policy);
+        } else if (args >= 3 && strcmp(keyword, "where") == 0) {
+            // subscribe <topic> where sender|contains|prefix <texto>
+            const char *predicate = strstr(input + 10, " where ") + 7;
+            if (strncmp(predicate, "sender ", 7) != 0 && strncmp(predicate, "contains ", 9) != 0 &&
+                strncmp(predicate, "prefix ", 7) != 0) {
+                printf("Filtro no válido (sender, contains o prefix seguido de un texto).\n");
+                return;
+            }
+            msg.command_type = 1;
+            strncpy(msg.topic, topic, sizeof(msg.topic));
+            snprintf(msg.message, sizeof(msg.message), "%s", predicate);
+        } else {
+            msg.command_type = 1;
+            strncpy(msg.topic, input + 10, sizeof(msg.topic));
+            msg.message[0] = '\0'; // sin filtro
+        }
+        // Si ya se tiene el diccionario del tópico, el manager no lo vuelve a enviar
+        Dictionary *dictionary = find_dictionary(msg.topic);
+        msg.dictionary = dictionary != NULL ? dictionary->id : 0;
         send_command_to_server(&msg);
 
     } else if (strcmp(input, "topics") == 0) {
@@ -77,10 +433,18 @@ void handle_user_input() {
         msg.topic[0] = '\0';
         send_command_to_server(&msg);
 
+    } else if (strcmp(input, "watch") == 0 || strcmp(input, "unwatch") == 0) {
+        // Vigilar el directorio de tópicos: instantánea inicial y después solo los cambios
+        msg.command_type = strcmp(input, "watch") == 0 ? 8 : 9;
+        msg.topic[0] = '\0';
+        send_command_to_server(&msg);
+
     } else if (strcmp(input, "exit") == 0) {
         msg.command_type = 3;
         printf("Cliente: Saliendo...\n");
         send_command_to_server(&msg);
+        print_receive_stats();
+        remove_client_pipes();
         exit(0);
 
     } else if (strncmp(input, "unsubscribe ", 12) == 0) {
@@ -113,7 +477,21 @@ void handle_user_input() {
         msg.topic[sizeof(msg.topic) - 1] = '\0';  // Asegura el fin de la cadena
         msg.lifetime = duration;
 
-        strncpy(msg.message, mensaje, TAM_MSG - 1);
+        // Clave opcional: msg <topic> <duración> key=<clave> <mensaje>
+        char *texto = mensaje;
+        msg.key[0] = '\0';
+        if (args == 3 && strncmp(mensaje, "key=", 4) == 0) {
+            size_t key_length = strcspn(mensaje + 4, " ");
+            if (key_length == 0 || key_length >= KEY_LEN || mensaje[4 + key_length] != ' ') {
+                printf("Error: la clave debe tener entre 1 y %d caracteres y el mensaje no puede estar vacío.\n", KEY_LEN - 1);
+                return;
+            }
+            memcpy(msg.key, mensaje + 4, key_length);
+            msg.key[key_length] = '\0';
+            texto = mensaje + 4 + key_length + 1;
+        }
+
+        strncpy(msg.message, texto, TAM_MSG - 1);
         msg.message[TAM_MSG - 1] = '\0';  // Asegura el fin de la cadena
 
         msg.command_type = 5;
@@ -126,14 +504,36 @@ void handle_user_input() {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Uso: %s <usuario>\n", argv[0]);
+    int valid = argc >= 2;
+    for (int i = 2; i < argc && valid; i++) {
+        if (strcmp(argv[i], "-q") == 0) {
+            // Modo silencioso para medir el rendimiento sin el coste del terminal
+            quiet_mode = 1;
+        } else if (strcmp(argv[i], "-z") == 0) {
+            // Recibir comprimidos los mensajes retenidos de los tópicos comprimidos
+            accepts_compressed = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            // Modo repartido: los tópicos están distribuidos entre varios managers
+            shard_count = atoi(argv[++i]);
+            valid = shard_count >= 1 && shard_count <= MAX_SHARDS;
+        } else {
+            valid = 0;
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "Uso: %s <usuario> [-q] [-z] [-s <shards>]\n", argv[0]);
         return EXIT_FAILURE;
     }
-    // Comprobar que solo ya está en ejecución el manager
-    if (!access(SERVER_PIPE, F_OK) == 0){
-        printf("No está el activo el servidor.\n");
-        exit(1);
+    shard_ring_init(&shard_ring, shard_count);
+
+    // Comprobar que ya están en ejecución todos los managers
+    for (int shard = 0; shard < shard_count; shard++) {
+        char server_pipe[64];
+        server_pipe_name(server_pipe, sizeof(server_pipe), shard, shard_count);
+        if (!access(server_pipe, F_OK) == 0){
+            printf("No está el activo el servidor.\n");
+            exit(1);
+        }
     }
 
     // Llamada a la función que configura los manejadores de señales
@@ -144,31 +544,55 @@ int main(int argc, char *argv[]) {
     msg.pid = getpid();
     msg.username[sizeof(msg.username) - 1] = '\0'; // nos aseguramos que el último índice del array es la finalización
 
-    // Usamos el PID para crear el nombre del pipe
-    snprintf(msg.client_pipe, sizeof(msg.client_pipe), "client_pipe_%d", msg.pid);
-    mkfifo(msg.client_pipe, 0600);
-
-    // Comando para inicio de sesión (0)
-    msg.command_type = 0; 
-    send_command_to_server(&msg);
+    // Usamos el PID para crear el nombre del pipe (uno por shard para que sus escrituras no se mezclen)
+    int client_fds[MAX_SHARDS];
+    int max_fd = 0;
+    for (int shard = 0; shard < shard_count; shard++) {
+        if (shard_count > 1) {
+            snprintf(client_pipes[shard], sizeof(client_pipes[shard]), "client_pipe_%d_%d", msg.pid, shard);
+        } else {
+            snprintf(client_pipes[shard], sizeof(client_pipes[shard]), "client_pipe_%d", msg.pid);
+        }
+        mkfifo(client_pipes[shard], 0600);
+
+        // Abrimos el pipe del cliente antes de iniciar sesión: el manager descarta las pipes sin lector
+        client_fds[shard] = open(client_pipes[shard], O_RDONLY | O_NONBLOCK);
+        if (client_fds[shard] == -1) {
+            perror("Error al abrir la pipe del cliente");
+            remove_client_pipes();
+            return EXIT_FAILURE;
+        }
+        // Mantener abierto un extremo de escritura para que select no devuelva EOF continuamente
+        // cuando el manager cierra la pipe entre envíos
+        if (open(client_pipes[shard], O_WRONLY) == -1) {
+            perror("Error al abrir la pipe del cliente para escritura");
+        }
+        if (client_fds[shard] > max_fd) {
+            max_fd = client_fds[shard];
+        }
+    }
+    OutputBatch batch = { .count = 0 };
 
-    // Creamos el pipe del cliente
-    int client_fd = open(msg.client_pipe, O_RDONLY | O_NONBLOCK);
-    if (client_fd == -1) {
-        perror("Error al abrir la pipe del cliente");
-        unlink(msg.client_pipe);
-        return EXIT_FAILURE;
+    // Comando para inicio de sesión (0), anunciando si se aceptan reenvíos comprimidos
+    msg.command_type = 0;
+    if (accepts_compressed) {
+        strcpy(msg.message, LZ_CAPABILITY);
     }
+    send_command_to_server(&msg);
 
     // Bucle infinito para leer y escribir comandos
     while (1) {
         fd_set read_fds;
         FD_ZERO(&read_fds); // limpia el conjunto de descriptores de archivo
-        FD_SET(0, &read_fds); // añade la entrada estándar al conjunto.
-        FD_SET(client_fd, &read_fds); // añade el descriptor del pipe del cliente al conjunto.
+        if (sessions_ready()) {
+            FD_SET(0, &read_fds); // añade la entrada estándar al conjunto (el manager rechaza los comandos sin sesión)
+        }
+        for (int shard = 0; shard < shard_count; shard++) {
+            FD_SET(client_fds[shard], &read_fds); // añade el descriptor del pipe de cada shard al conjunto.
+        }
 
         // Espera actividad en los descriptores de archivo especificados.
-        int activity = select(client_fd + 1, &read_fds, NULL, NULL, NULL);
+        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
 
         // Comprueba si ocurrió un error en select
         if (activity == -1) {
@@ -181,13 +605,10 @@ int main(int argc, char *argv[]) {
             handle_user_input();
         }
 
-        // Si hay actividad en la respuesta del servidor, se imprime la respuesta
-        if (FD_ISSET(client_fd, &read_fds)) {
-            char response[256];
-            ssize_t bytes_read = read(client_fd, response, sizeof(response) - 1);
-            if (bytes_read > 0) {
-                response[bytes_read] = '\0'; // la cadena debe acabarse con el caracter nulo
-                printf("%s\n", response);
+        // Si hay actividad en la respuesta del servidor, se procesan los mensajes completos recibidos
+        for (int shard = 0; shard < shard_count; shard++) {
+            if (FD_ISSET(client_fds[shard], &read_fds) && fill_ring(&rings[shard], client_fds[shard]) > 0) {
+                process_ring(&rings[shard], &batch);
             }
         }
     }
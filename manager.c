@@ -1,12 +1,250 @@
 #include "util.h"
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define SHOW_PAGE_SIZE 20 // Mensajes por página del comando show si no se indica otro límite
+#define INGEST_RECORDS 32 // Comandos que se leen como máximo en cada lectura de la pipe del servidor
+#define DEFAULT_BATCH_LATENCY_US 1000 // Latencia máxima añadida por la agrupación de entregas
+#define BLOCKED_RETRY_MIN_US 1000 // Espera mínima entre reintentos a los clientes con la pipe llena (aunque --batch-us sea 0)
+#define DEFAULT_BATCH_BYTES 16384 // Bytes pendientes a partir de los que se vacía la bandeja de un cliente
+#define OUTBOX_LIMIT (1024 * 1024) // Máximo de bytes pendientes por carril de un cliente antes de descartar mensajes
+#define DEFAULT_STARVATION_WRITES 4 // Escrituras seguidas que un carril cede a los de más prioridad antes de pasar delante
+#define PERSIST_BATCH_SIZE 65536 // Tamaño del bloque de escritura del hilo de persistencia
+#define PERSIST_LINE_MAX (TOPIC_NAME_LEN + USERNAME_LEN + KEY_LEN + TAM_MSG + 16) // Línea más larga del archivo de mensajes
+#define TRACE_MAGIC "MSGTRACE" // Cabecera de los archivos de traza
+#define TRACE_VERSION 3
+#define MAX_COMMAND_TYPES 16 // Tipos de comando distinguidos en el informe de latencias
+#define REPL_HEARTBEAT_MS 100 // Intervalo de los latidos del principal en el registro de replicación
+#define REPL_POLL_US 10000 // Espera del manager en espera cuando no hay registros nuevos
+#define DEFAULT_FAILOVER_MS 1000 // Tiempo sin latidos tras el que el manager en espera toma el relevo
+#define REPL_IDLE_BYTES 65536 // Tamaño del registro de replicación solo con latidos a partir del que se reinicia igualmente
+#define ARENA_CHUNK_SIZE 16384 // Tamaño de cada bloque de la arena de mensajes
+#define MAX_NAMES 1024 // Máximo de nombres distintos (tópicos y remitentes) en los mensajes retenidos
+#define NAME_BUCKETS 256 // Cubetas de la tabla hash de nombres (potencia de 2)
+#define CLIENT_BUCKETS 4096 // Cubetas de la tabla hash de usuarios conectados (potencia de 2)
+#define DEFAULT_FANOUT_WIDTH 256 // Destinatarios a partir de los que el reparto se divide entre los hilos de reparto
+#define MAX_FANOUT_THREADS 64
+#define MAX_FILTERS 8 // Filtros distintos por tópico (los suscriptores con el mismo filtro lo comparten)
+#define FILTER_LEN 64 // Longitud máxima del texto de un filtro (con el caracter nulo)
+#define TOPIC_PAGE_SIZE 1024 // Tamaño máximo de cada página del listado de tópicos
+#define SESSION_TOKEN(slot, generation) ((uint32_t)(generation) << 16 | (uint32_t)(slot)) // Identificador de sesión (nunca 0)
+
+#define URING_ENTRIES 256 // Entradas del anillo de envío de io_uring (escrituras por llamada)
+#define URING_OP_READ_MULTISHOT 49 // IORING_OP_READ_MULTISHOT (Linux 6.7), ausente en cabeceras antiguas
+#define INGEST_BUFFERS 8 // Buffers registrados para leer la pipe del servidor con io_uring (potencia de 2)
+#define INGEST_BUFFER_SIZE (INGEST_RECORDS * sizeof(Response)) // Tamaño de cada buffer registrado
+#define INGEST_GROUP 0 // Grupo de buffers registrados de la pipe del servidor
+#define KEY_SLOT_BITS 8
+#define KEY_SLOTS (1 << KEY_SLOT_BITS) // Huecos de la tabla de últimos valores de un tópico compactado
+#define NO_KEY 0xFFFF // Mensaje retenido sin clave
+#define TOPIC_RETAINED_LIMIT 5 // Mensajes persistentes que retiene un tópico
+#define COMPACTED_KEYS_LIMIT MAX_MESSAGES // Claves distintas que retiene un tópico compactado (las que caben en su índice)
+
+#if KEY_SLOTS <= MAX_MESSAGES
+#error "La tabla de últimos valores debe tener más huecos que mensajes retenidos"
+#endif
+
+#if MAX_USERS > 65535
+#error "MAX_USERS no cabe en los 16 bits de hueco del identificador de sesión"
+#endif
+
+// Tipos de registro de la cola de persistencia
+#define PERSIST_APPEND 0 // Añadir un mensaje persistente al final del archivo
+#define PERSIST_SNAPSHOT 1 // Reemplazar el archivo con el estado completo
+
+// Líneas del archivo de mensajes con los bloques de los tópicos comprimidos
+#define LZ_DISK_DICT_TAG "#lzdict " // Diccionario de un tópico
+#define LZ_DISK_TAG "#lz " // Mensajes retenidos de un tópico comprimidos con su diccionario
+#define COMPACT_DISK_TAG "#compact " // Tópico compactado por clave
+#define COMPRESS_DISK_TAG "#compress " // Tópico comprimido cuyos mensajes se escriben sin comprimir
+
+// Origen de los comandos grabados en una traza
+#define TRACE_CLIENT 0 // Comando recibido de un cliente por la pipe del servidor
+#define TRACE_ADMIN 1 // Comando escrito por el administrador
+#define TRACE_REAP 2 // Sesión de un cliente muerto eliminada por el manager
+#define TRACE_HEARTBEAT 3 // Latido del principal (solo en el registro de replicación)
+#define TRACE_RETAINED 4 // Mensaje persistente que el manager tenía al empezar a grabar
+#define TRACE_SESSION 5 // Cliente conectado al reiniciar el registro de replicación, con su identificador de sesión
+#define TRACE_DIRECTORY 6 // Secuencia del directorio de tópicos al reiniciar el registro de replicación
+
+// Carriles de la bandeja de salida de cada cliente, de más a menos prioridad
+#define LANE_CONTROL 0 // Respuestas, confirmaciones y avisos del sistema
+#define LANE_HIGH 1 // Mensajes de los tópicos de prioridad alta
+#define LANE_NORMAL 2 // Mensajes de los tópicos de prioridad normal (por defecto)
+#define LANE_LOW 3 // Mensajes de los tópicos de prioridad baja
+#define LANES 4
+
+// Motivos de vaciado de las bandejas de salida (para las estadísticas)
+#define FLUSH_IDLE 0 // No hay más comandos pendientes
+#define FLUSH_LATENCY 1 // Se alcanzó la latencia máxima
+#define FLUSH_SIZE 2 // Se alcanzó el tamaño máximo del lote
+#define FLUSH_RETRY 3 // Reintento tras encontrar llena la pipe del cliente
+#define FLUSH_REASONS 4
+
+// Mecanismos de entrada/salida (--io)
+#define IO_POLL 0 // poll y una llamada al sistema por lectura o escritura
+#define IO_URING 1 // io_uring: lecturas multishot de la pipe del servidor y escrituras enviadas en bloque
+
+// Trabajos del grupo de hilos de reparto
+#define FANOUT_SEND 0 // Encolar un mensaje en las bandejas de los destinatarios
+#define FANOUT_FLUSH 1 // Vaciar las bandejas de los clientes
+
+// Tipos de filtro de las suscripciones
+#define FILTER_SENDER 0 // Solo los mensajes de un remitente
+#define FILTER_CONTAINS 1 // Solo los mensajes que contienen un texto
+#define FILTER_PREFIX 2 // Solo los mensajes que empiezan por un texto
+
+// Políticas de reparto de los grupos de consumidores
+#define GROUP_ROUND_ROBIN 0 // Turno rotatorio entre los miembros
+#define GROUP_LEAST_QUEUE 1 // Miembro con menos bytes pendientes en su pipe
+
+// Struct para la limitación de envíos con un cubo de tokens (token bucket)
+typedef struct {
+    double rate; // Tokens que se recargan por segundo (0 = sin límite)
+    double burst; // Capacidad máxima del cubo (ráfaga permitida)
+    double tokens; // Tokens disponibles
+    struct timespec last_refill; // Momento de la última recarga
+    unsigned long rejected; // Envíos rechazados desde que se configuró el límite
+} RateLimit;
+
+// Struct de un carril de la bandeja de salida de un cliente
+typedef struct {
+    char *data; // Mensajes pendientes del carril, uno detrás de otro y terminados en nulo
+    size_t len; // Bytes pendientes del carril
+    size_t cap; // Capacidad reservada del carril
+    long *stamps; // Momento de encolado (us del reloj monótono) de cada mensaje pendiente, en orden
+    size_t stamp_head; // Primer momento de stamps que sigue pendiente
+    size_t stamp_count; // Momentos guardados en stamps, incluidos los anteriores a stamp_head
+    size_t stamp_cap; // Capacidad reservada de stamps
+    int skipped; // Escrituras seguidas en las que avanzó un carril de más prioridad y este no
+} Lane;
 
 // Struct de almacenamiento de usuarios
 typedef struct {
     char client_pipe[256]; // Descriptor de archivo del pipe para comunicación con el cliente
     char username[USERNAME_LEN]; // Nombre de usuario del cliente
     pid_t pid; // PID del proceso del cliente
+    RateLimit limit; // Límite de envíos del cliente
+    int is_dead; // Indicador de que su pipe ya no tiene lector (pendiente de eliminar)
+    int fd; // Descriptor abierto de su pipe (-1 si aún no se ha abierto)
+    Lane lanes[LANES]; // Bandeja de salida: mensajes pendientes de entregar por carril de prioridad
+    size_t outbox_len; // Bytes pendientes de entregar entre todos los carriles
+    int split_lane; // Carril cuyo primer mensaje quedó a medio escribir y debe terminarse antes que nada (-1 si no hay)
+    struct iovec iov[LANES + 1]; // Escritura preparada por plan_write, en orden de entrega
+    int iov_lane[LANES + 1]; // Carril de cada parte de la escritura preparada
+    int iov_count; // Partes de la escritura preparada
+    struct timespec oldest_pending; // Momento en que se encoló el mensaje pendiente más antiguo
+    int is_blocked; // Indicador de que su pipe estaba llena en el último intento de entrega
+    int next_in_bucket; // Siguiente cliente de la misma cubeta de la tabla hash (-1 si es el último)
+    int watches_directory; // Indicador de que recibe los cambios del directorio de tópicos
+    int session; // Hueco de su sesión en la tabla de sesiones
+    int accepts_compressed; // Indicador de que anunció al conectarse que acepta reenvíos comprimidos
 } Client;
 
+// Struct de un hueco de la tabla de sesiones. El hueco no cambia mientras dura la sesión aunque el
+// cliente se desplace en clients[]; la generación cambia al cerrarla para rechazar identificadores caducados
+typedef struct {
+    uint16_t generation; // Generación actual del hueco (nunca 0)
+    int client; // Índice del cliente en clients[] (-1 si el hueco está libre)
+} Session;
+
+// Struct de estadísticas de entrega a los clientes
+typedef struct {
+    unsigned long frames; // Mensajes encolados para los clientes
+    unsigned long writes; // Llamadas al sistema de escritura en pipes de clientes
+    unsigned long flushes[FLUSH_REASONS]; // Vaciados de bandejas por motivo
+    unsigned long dropped; // Mensajes descartados por bandeja llena
+    unsigned long publishes; // Mensajes repartidos a los suscriptores de un tópico
+    unsigned long parallel_publishes; // Repartos divididos entre los hilos de reparto
+    unsigned long long publish_ns; // Tiempo total de reparto
+    unsigned long long publish_max_ns; // Reparto más lento
+    unsigned long filter_evaluations; // Filtros evaluados (una vez por filtro y publicación)
+    unsigned long filtered_out; // Entregas evitadas por los filtros
+    unsigned long syscalls; // Llamadas al sistema de las entregas (write o io_uring_enter)
+    unsigned long lane_frames[LANES]; // Mensajes encolados por carril
+    unsigned long lane_delivered[LANES]; // Mensajes escritos por completo en la pipe por carril
+    unsigned long long lane_wait_us[LANES]; // Espera total en la bandeja de los mensajes escritos por carril
+    unsigned long lane_wait_max_us[LANES]; // Espera máxima en la bandeja por carril
+    unsigned long promotions; // Escrituras en las que un carril cedido demasiadas veces pasó delante
+} DeliveryStats;
+
+// Struct de un hilo de reparto: atiende a los clientes cuyo índice módulo el número de partes es su parte
+typedef struct {
+    pthread_t thread;
+    int part; // Parte de la tabla de clientes que le corresponde
+    unsigned long seen; // Último trabajo atendido (al arrancar, el número de trabajo en curso)
+    DeliveryStats stats; // Estadísticas propias, se suman a las globales al terminar cada trabajo
+} FanoutWorker;
+
+// Struct del trabajo compartido por los hilos de reparto (el hilo que publica hace la última parte)
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start; // Avisa a los hilos de que hay un trabajo nuevo
+    pthread_cond_t done; // Avisa al hilo que publica de que todas las partes han terminado
+    unsigned long generation; // Número de trabajo, cambia con cada trabajo nuevo
+    int pending; // Hilos que aún no han terminado su parte
+    int shutdown; // Flag para que los hilos terminen
+    int kind; // FANOUT_SEND o FANOUT_FLUSH
+    const int *targets; // Índices de los clientes destinatarios (FANOUT_SEND)
+    int target_count;
+    const char *message; // Mensaje a encolar (FANOUT_SEND)
+    int lane; // Carril en el que se encola el mensaje (FANOUT_SEND)
+    int reason; // Motivo del vaciado (FANOUT_FLUSH)
+} FanoutPool;
+
+// Struct de estadísticas de la replicación
+typedef struct {
+    unsigned long records; // Registros escritos (principal) o aplicados (en espera)
+    unsigned long long lag_ns; // Retraso del último registro aplicado respecto a su escritura
+    unsigned long long max_lag_ns; // Mayor retraso observado
+    long behind_bytes; // Bytes del registro pendientes de aplicar en la última comprobación
+    double failover_ms; // Tiempo desde el último registro del principal hasta tomar el relevo
+    unsigned long rotations; // Veces que el registro se ha reiniciado con el estado completo
+} ReplicationStats;
+
+// Struct de estadísticas de la compresión de los mensajes retenidos
+typedef struct {
+    unsigned long disk_blocks; // Bloques comprimidos escritos en el archivo
+    unsigned long long disk_raw_bytes; // Bytes de esos bloques sin comprimir
+    unsigned long long disk_bytes; // Bytes de esos bloques y de sus diccionarios tal como se escriben
+    unsigned long disk_skipped; // Tópicos escritos sin comprimir por no reducir su tamaño
+    unsigned long long disk_ns; // Tiempo de compresión de los bloques del archivo
+    unsigned long replay_blocks; // Reenvíos comprimidos a los suscriptores nuevos
+    unsigned long replay_skipped; // Reenvíos que se mandaron sin comprimir por no reducir su tamaño
+    unsigned long long replay_raw_bytes; // Bytes de los reenvíos comprimidos sin comprimir
+    unsigned long long replay_bytes; // Bytes de los reenvíos comprimidos y de los diccionarios enviados con ellos
+    unsigned long long replay_ns; // Tiempo de compresión de los reenvíos
+    unsigned long dictionary_sends; // Diccionarios enviados a clientes que no lo tenían
+    unsigned long long dictionary_bytes; // Bytes de esos diccionarios
+} CompressionStats;
+
+// Struct de un anillo de io_uring usado con llamadas al sistema directas (sin liburing)
+typedef struct {
+    int fd; // Descriptor del anillo (-1 si no se usa)
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array; // Cola de envío compartida con el núcleo
+    unsigned *cq_head, *cq_tail, *cq_mask; // Cola de finalizaciones compartida con el núcleo
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes; // Operaciones de la cola de envío
+    struct io_uring_cqe *cqes; // Resultados de la cola de finalizaciones
+    unsigned queued; // Operaciones preparadas que aún no se han enviado al núcleo
+    void *sq_ring, *cq_ring; // Zonas proyectadas de las colas (para liberarlas)
+    size_t sq_ring_size, cq_ring_size;
+} Uring;
+
 // Struct de comunicación con el cliente
 typedef struct {
     char client_pipe[256]; // Descriptor de archivo del pipe para comunicación con el cliente
@@ -16,770 +254,4571 @@ typedef struct {
     pid_t pid; // PID del proceso del cliente
     int lifetime; // Lifetime restante
     char message[TAM_MSG]; // Mensaje que se envía
+    uint32_t session; // Identificador de sesión recibido al conectarse (0 = sin sesión, se busca por nombre)
+    char key[KEY_LEN]; // Clave del mensaje en los tópicos compactados (vacía si no tiene)
+    uint32_t dictionary; // Diccionario del tópico que el cliente ya tiene al suscribirse (0 = ninguno)
 } Response;
 
+// Struct para la gestión de grupos de consumidores (cada mensaje se entrega a un único miembro)
+typedef struct {
+    char name[GROUP_NAME_LEN]; // Nombre del grupo
+    char members[MAX_SUBSCRIBERS][USERNAME_LEN]; // Nombres de los usuarios que forman el grupo
+    int member_count; // Número de miembros del grupo
+    int policy; // Política de reparto (GROUP_ROUND_ROBIN o GROUP_LEAST_QUEUE)
+    int next_member; // Siguiente miembro en el turno rotatorio
+} ConsumerGroup;
+
+// Struct de un filtro de suscripción, compartido por todos los suscriptores del tópico que lo usan
+typedef struct {
+    int kind; // FILTER_SENDER, FILTER_CONTAINS o FILTER_PREFIX
+    char text[FILTER_LEN]; // Remitente o texto buscado
+    size_t length; // Longitud del texto
+    int refs; // Suscriptores que lo usan (0 = hueco libre)
+} TopicFilter;
+
 // Struct para la gestión de topicos
 typedef struct {
     char name[TOPIC_NAME_LEN]; // Nombre del tópico
     char subscribers[MAX_SUBSCRIBERS][USERNAME_LEN]; // Matriz para almacenar los nombres de usuarios suscritos a un tópico
+    int subscriber_filters[MAX_SUBSCRIBERS]; // Filtro de cada suscriptor (-1 = recibe todos los mensajes)
     int subscriber_count; // Número de suscriptores al tópico.
+    TopicFilter filters[MAX_FILTERS]; // Filtros distintos de los suscriptores
     int is_locked; // Indicador de si el tópico está bloqueado.
     int has_active_messages;  // Indicador de si el tópico tiene mensajes activos
+    ConsumerGroup groups[MAX_GROUPS]; // Grupos de consumidores del tópico
+    int group_count; // Número de grupos de consumidores
+    RateLimit limit; // Límite de envíos al tópico
+    int is_durable; // Indicador de que los envíos se confirman tras llegar al disco
+    struct MessageRecord *message_index[MAX_MESSAGES]; // Mensajes persistentes del tópico, por orden de llegada
+    int message_index_count; // Número de mensajes persistentes del tópico
+    int is_compacted; // Indicador de que solo se retiene el último mensaje de cada clave
+    int lane; // Carril de entrega de sus mensajes (LANE_HIGH, LANE_NORMAL o LANE_LOW)
+    struct MessageRecord *latest[KEY_SLOTS]; // Último mensaje de cada clave (tabla hash abierta, solo si está compactado)
+    int is_compressed; // Indicador de que sus mensajes retenidos se comprimen en el archivo y en los reenvíos
+    uint32_t dictionary_id; // Identificador de su diccionario (0 hasta entrenarlo)
+    int dictionary_len; // Bytes de su diccionario
+    char dictionary[LZ_DICT_SIZE]; // Diccionario compartido con los clientes: texto reciente de sus mensajes
 } Topic;
 
-// Struct para el almacenamiento de mensajes en el archivo
-typedef struct {
-    char topic[TOPIC_NAME_LEN]; // Nombre del tópico al que pertenece el mensaje
-    char username[USERNAME_LEN]; // Nombre del usuario que envió el mensaje
-    char message[TAM_MSG];  // El contenido del mensaje
+// Struct para el almacenamiento de un mensaje persistente (registro de longitud variable en la arena)
+typedef struct MessageRecord {
+    uint32_t created; // Momento en que se recibió el mensaje (segundos desde 1970)
     int lifetime; // Lifetime restante
-    Response msg;
-} StoredMessage;
+    uint16_t topic_id; // Nombre del tópico en la tabla de nombres
+    uint16_t sender_id; // Nombre del usuario que envió el mensaje en la tabla de nombres
+    uint16_t length; // Longitud del mensaje sin el caracter nulo
+    uint16_t key_id; // Clave del mensaje en la tabla de nombres (NO_KEY si no tiene)
+    char text[]; // El contenido del mensaje (terminado en nulo)
+} MessageRecord;
+
+// Bloque de memoria de la arena de mensajes
+typedef struct ArenaChunk {
+    struct ArenaChunk *next; // Siguiente bloque
+    size_t used; // Bytes ocupados
+    size_t capacity; // Bytes disponibles en data
+    char data[]; // Registros
+} ArenaChunk;
+
+// Arena de mensajes: reserva lineal en bloques y liberación de todos los bloques a la vez
+typedef struct {
+    ArenaChunk *head; // Bloque actual (el resto están encadenados detrás)
+    size_t chunk_count; // Número de bloques
+    size_t reserved; // Bytes reservados en total
+    size_t used; // Bytes ocupados por registros
+} Arena;
+
+// Entrada de la tabla de nombres compartidos por los mensajes retenidos
+typedef struct {
+    char *name; // Nombre (NULL si la entrada está libre)
+    int refs; // Mensajes que lo referencian
+    int next; // Siguiente entrada de la misma cubeta (-1 si no hay)
+} NameEntry;
+
+// Registro pendiente de escribir en el archivo de mensajes
+typedef struct PersistRecord {
+    struct PersistRecord *_Atomic next; // Siguiente registro de la cola
+    int kind; // Tipo de registro (PERSIST_APPEND o PERSIST_SNAPSHOT)
+    char *data; // Texto ya formateado que se escribe en el archivo
+    size_t len; // Longitud del texto
+    char ack_pipe[256]; // Pipe a la que confirmar el envío tras persistirlo ("" si no hay que confirmar)
+} PersistRecord;
+
+// Cola sin bloqueos de varios productores y un consumidor (MPSC) para el hilo de persistencia
+typedef struct {
+    PersistRecord *_Atomic head; // Último registro encolado (extremo de los productores)
+    PersistRecord *tail; // Siguiente registro a extraer (extremo del consumidor)
+    PersistRecord stub; // Nodo auxiliar para que la cola nunca quede sin nodos
+} PersistQueue;
 
 // Creación de los hilos
 pthread_t lifetime_thread;
 pthread_t command_thread;
+pthread_t persist_thread;
+
+PersistQueue persist_queue; // Registros pendientes de escribir en el archivo
+sem_t persist_sem; // Avisa al hilo de persistencia de que hay registros
+int persist_shutdown = 0; // Flag para que el hilo de persistencia termine tras vaciar la cola
 
 Topic topics[MAX_TOPICS]; // Almacena los topicos creados
 Client clients[MAX_USERS]; // Almacena los usuarios conectados
-StoredMessage messages[MAX_MESSAGES]; // Almacena los mensajes de los topicos
+MessageRecord *messages[MAX_MESSAGES]; // Mensajes persistentes de los topicos, por orden de llegada
+Arena message_arena; // Memoria de los mensajes persistentes
+NameEntry name_table[MAX_NAMES]; // Nombres de tópicos y remitentes de los mensajes persistentes
+int name_buckets[NAME_BUCKETS]; // Primera entrada de cada cubeta (-1 si está vacía)
+int name_count = 0; // Entradas ocupadas en la tabla de nombres
 int topic_count = 0;
 int client_count = 0;
 int message_count = 0;
 pthread_mutex_t mutex; // Declaración del mutex
+RateLimit default_client_limit; // Límite que se aplica a los clientes que se conectan
+DeliveryStats delivery_stats; // Estadísticas de entrega
+long max_batch_latency_us = DEFAULT_BATCH_LATENCY_US; // Latencia máxima añadida por la agrupación
+size_t batch_max_bytes = DEFAULT_BATCH_BYTES; // Tamaño máximo del lote por cliente
+int starvation_writes = DEFAULT_STARVATION_WRITES; // Escrituras que un carril cede antes de adelantarse a los de más prioridad
+FILE *trace_file = NULL; // Archivo donde se graban los comandos recibidos (NULL si no se graba)
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER; // Protege el archivo de traza
+struct timespec trace_start; // Momento en que empezó la grabación
+int replay_mode = 0; // Indicador de reproducción de una traza (sin clientes reales)
+int client_buckets[CLIENT_BUCKETS]; // Primer cliente de cada cubeta (-1 si está vacía)
+Session sessions[MAX_USERS]; // Tabla de sesiones de los clientes conectados
+int free_sessions[MAX_USERS]; // Pila de huecos libres de la tabla de sesiones
+int free_session_count = 0;
+FanoutWorker fanout_workers[MAX_FANOUT_THREADS]; // Hilos de reparto
+FanoutPool fanout_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+int fanout_threads = -1; // Hilos de reparto además del que publica (-1 = uno menos que los núcleos)
+int fanout_min_width = DEFAULT_FANOUT_WIDTH; // Destinatarios a partir de los que se reparte en paralelo
+int shard_index = 0; // Shard que atiende este manager en el modo repartido
+int shard_count = 1; // Número de managers del modo repartido (1 = un solo manager)
+ShardRing shard_ring; // Reparto de los tópicos entre los shards
+char server_pipe_path[64] = SERVER_PIPE; // Pipe del servidor de este manager
+FILE *repl_file = NULL; // Registro de replicación que sigue el manager en espera (NULL si no se replica)
+char repl_log_path[256]; // Ruta del registro de replicación (se reinicia con cada snapshot)
+unsigned long repl_changes = 0; // Registros distintos de los latidos escritos desde el último reinicio del registro
+pthread_mutex_t admin_mutex = PTHREAD_MUTEX_INITIALIZER; // Ordena los comandos del administrador con el reinicio del registro
+pthread_t repl_thread; // Hilo de latidos del registro de replicación
+int repl_shutdown = 0; // Flag para que el hilo de latidos termine
+int standby_mode = 0; // Indicador de manager en espera aplicando el registro del principal
+long failover_ms = DEFAULT_FAILOVER_MS; // Tiempo sin latidos tras el que se toma el relevo
+ReplicationStats replication_stats; // Estadísticas de la replicación
+CompressionStats compression_stats; // Estadísticas de la compresión de los mensajes retenidos
+int command_thread_started = 0; // Indicador de que el hilo de comandos del administrador está en marcha
+int lifetime_thread_started = 0; // Indicador de que el hilo del lifetime está en marcha (no en la reproducción)
+_Thread_local DeliveryStats *local_stats = &delivery_stats; // Estadísticas del hilo que entrega
+unsigned long long directory_seq = 0; // Número de secuencia del último cambio del directorio de tópicos
+int directory_watchers = 0; // Clientes que vigilan el directorio de tópicos
+int io_backend = IO_POLL; // Mecanismo de entrada/salida de las entregas y de la pipe del servidor
+Uring delivery_ring = { .fd = -1 }; // Anillo de las entregas (se usa con el mutex cogido)
+Uring ingest_ring = { .fd = -1 }; // Anillo de lectura de la pipe del servidor (solo el hilo principal)
+struct io_uring_buf_ring *ingest_buffer_ring = NULL; // Buffers registrados de la pipe del servidor
+char *ingest_pool = NULL; // Memoria de los buffers registrados
+unsigned short ingest_buffer_tail = 0; // Posición de la siguiente devolución de un buffer al núcleo
+int ingest_multishot = 1; // Indicador de lectura multishot (se desactiva si el núcleo no la admite)
+unsigned long superseded_messages = 0; // Mensajes retenidos sustituidos por un valor más reciente de su clave
+unsigned long ingest_syscalls = 0; // Llamadas al sistema para recibir comandos (poll, read o io_uring_enter)
 
 // Flag para la eliminación de hilos
 int terminate_thread = 0;
 
-// Función para enviar un mensaje a un cliente
-void send_response(const char *client_pipe, const char *message) {
-    int fd = open(client_pipe, O_WRONLY);
-    if (fd != -1) {
-        write(fd, message, strlen(message) + 1); // +1 para incluir el carácter nulo
-        close(fd);
-    } else {
-        perror("Error al abrir la pipe del cliente");
+// Función para crear un anillo de io_uring y proyectar sus colas, devuelve -1 si el núcleo no lo permite
+int uring_setup(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
     }
-}
 
-// Función para eliminar todos los usuarios conectados y cerrar el manager (close y CTRL+C del manager)
-void close_all_connections() {
-    // Cerrar todas las conexiones de clientes
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].pid > 0) {
-            kill(clients[i].pid, SIGTERM); // Enviar SIGTERM al cliente
-            printf("Se envió SIGTERM a %s (PID: %d)\n", clients[i].username, clients[i].pid);
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        // Las dos colas comparten una sola proyección
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
         }
+        ring->cq_ring_size = 0;
     }
-
-    // Enviar SIGUSR1 a los hilos
-    pthread_kill(lifetime_thread, SIGUSR1);  // Solicitar a lifetime_thread que se cierre
-    pthread_kill(command_thread, SIGUSR1);   // Solicitar a command_thread que se cierre
-
-    // Esperar a que los hilos terminen correctamente
-    pthread_join(lifetime_thread, NULL);
-    printf("Lifetime thread finalizado.\n");
-
-    pthread_join(command_thread, NULL);
-    printf("Command thread finalizado.\n");
-}
-
-
-// Función para manejar la señal SIGINT (CTRL+C) del programa
-void handle_sigint(int sig) {
-    printf("\nServidor finalizado. Limpiando recursos...\n");
-    close_all_connections();
-    unlink(SERVER_PIPE);
-    exit(0); 
-}
-
-
-// Función para añadir un usuario a la lista de usuarios conectados
-void add_client(const char *client_pipe, const char *username, pid_t pid) {
-    // Verificar si el cliente ya está conectado
-    for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].username, username) == 0) {
-            printf("El cliente %s ya está conectado (PID: %d)\n", username, clients[i].pid);
-            return; // No agregar el cliente nuevamente
-        }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->cq_ring_size == 0 ? ring->sq_ring :
+                    mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
     }
 
-    // Si no está, añadir el cliente
-    if (client_count < MAX_USERS) {
-        strncpy(clients[client_count].client_pipe, client_pipe, sizeof(clients[client_count].client_pipe) - 1);
-        strncpy(clients[client_count].username, username, USERNAME_LEN);
-        clients[client_count].pid = pid;
-        client_count++;
-        printf("Cliente agregado: %s (PID: %d)\n", username, pid);
-    } else {
-        printf("No se puede agregar el cliente %s. Límite máximo de usuarios alcanzado.\n", username);
-    }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sq_entries = params.sq_entries;
+    ring->queued = 0;
+    return 0;
 }
 
-// Función para suscribir un usuario a un topico y recibir los mensajes de ese topico
-void subscribe_topic(const char *topic_name, const char *client_pipe, const char *username) {
-    if (strlen(topic_name) >= TOPIC_NAME_LEN) {
-        send_response(client_pipe, "Error: El nombre del tópico excede el máximo de caracteres.");
+// Función para cerrar un anillo de io_uring
+void uring_close(Uring *ring) {
+    if (ring->fd == -1) {
         return;
     }
-
-    // Comprobar si se ha alcanzado el límite de tópicos
-    if (topic_count >= MAX_TOPICS) {
-        send_response(client_pipe, "Error: máximo de tópicos alcanzado.");
-        return;
+    munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring_size > 0) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
     }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
 
-    // Buscar si el tópico ya existe
-    int topic_index = -1;
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].name, topic_name) == 0) {
-            topic_index = i;
-            break;
-        }
+// Función para preparar una operación en la cola de envío, devuelve NULL si la cola está llena
+struct io_uring_sqe *uring_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->queued;
+    if (tail - head >= ring->sq_entries) {
+        return NULL;
     }
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
 
-    // Si no existe el topico, crear uno nuevo y agregar al primer suscriptor
-    if (topic_index == -1) {
-        strncpy(topics[topic_count].name, topic_name, TOPIC_NAME_LEN);
-        topics[topic_count].name[TOPIC_NAME_LEN - 1] = '\0';
-        topics[topic_count].subscriber_count = 0;
-
-        // Agregar el primer suscriptor (el usuario que se suscribe)
-        strncpy(topics[topic_count].subscribers[0], username, USERNAME_LEN);
-        topics[topic_count].subscriber_count++;
-
-        // Imprimir mensaje en el servidor
-        printf("El usuario '%s' ha creado y se ha suscrito al tópico '%s'.\n", username, topic_name);
-
-        topic_count++;
-
-        // Enviar respuesta al cliente
-        send_response(client_pipe, "Tópico creado y suscrito.");
+// Función para enviar al núcleo las operaciones preparadas y esperar a que terminen al menos wait,
+// todo en una sola llamada al sistema
+int uring_submit(Uring *ring, unsigned wait) {
+    unsigned submit = ring->queued;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->queued = 0;
+    return syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
 
+// Función para esperar una finalización durante como mucho wait_us microsegundos (-1 = sin límite),
+// devuelve -1 con errno ETIME si se cumple el plazo
+int uring_wait(Uring *ring, long wait_us) {
+    if (wait_us < 0) {
+        return uring_submit(ring, 1);
     }
-    else{
-        // Buscar el tópico en la lista de tópicos
-        for (int i = 0; i < topic_count; i++) {
-            if (strcmp(topics[i].name, topic_name) == 0) {
-                // Verificar si el usuario ya está suscrito
-                for (int j = 0; j < topics[i].subscriber_count; j++) {
-                    if (strcmp(topics[i].subscribers[j], username) == 0) {
-                        send_response(client_pipe, "Ya estás suscrito al tópico.");
-                        return;
-                    }
-                }
+    struct __kernel_timespec ts = { .tv_sec = wait_us / 1000000, .tv_nsec = wait_us % 1000000 * 1000 };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+    unsigned submit = ring->queued;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->queued = 0;
+    return syscall(__NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
 
-                // Si el usuario no está suscrito, agregarlo
-                if (topics[i].subscriber_count < MAX_SUBSCRIBERS) {
-                    strncpy(topics[i].subscribers[topics[i].subscriber_count], username, USERNAME_LEN);
-                    topics[i].subscribers[topics[i].subscriber_count][USERNAME_LEN - 1] = '\0';
-                    topics[i].subscriber_count++;
+// Función para consultar el siguiente resultado sin llamar al sistema, devuelve NULL si no hay ninguno
+struct io_uring_cqe *uring_peek(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
 
-                    // Imprimir mensaje en el servidor
-                    printf("El usuario '%s' se ha suscrito al tópico '%s'.\n", username, topic_name);
+// Función para liberar el resultado consultado con uring_peek
+void uring_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
 
-                    // Almacenar los mensajes en una lista (buffer)
-                    char all_messages[1024 * MAX_MESSAGES];  // Suponiendo un límite de mensajes
-                    for (int j = 0; j < message_count; j++) {
-                        if (strcmp(messages[j].topic, topic_name) == 0 && messages[j].lifetime > 0) {
-                            // Concatenar el mensaje al buffer
-                            char message_to_send[1024];
-                            snprintf(message_to_send, sizeof(message_to_send), "%s %s %s\n", messages[j].topic, messages[j].username, messages[j].message);
-                            strncat(all_messages, message_to_send, sizeof(all_messages) - strlen(all_messages) - 1);
-                        }
-                    }
+// Función para calcular los microsegundos transcurridos desde un instante
+long elapsed_us(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L + (now.tv_nsec - since->tv_nsec) / 1000;
+}
 
-                    // Enviar todos los mensajes de una vez
-                    if (strlen(all_messages) > 0) {
-                        send_response(client_pipe, all_messages);
-                    }
+// Función para calcular los nanosegundos transcurridos desde un instante
+unsigned long long elapsed_ns(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000ULL + (now.tv_nsec - since->tv_nsec);
+}
 
-                    // Informar a los suscriptores actuales del tópico
-                    printf("Usuarios suscritos al tópico '%s':\n", topic_name);
-                    for (int j = 0; j < topics[i].subscriber_count; j++) {
-                        printf(" - %s\n", topics[i].subscribers[j]);
-                    }
+// Función para obtener el instante actual en microsegundos del reloj monótono
+long monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
 
-                    send_response(client_pipe, "Te has suscrito al tópico.");
-                } else {
-                    send_response(client_pipe, "Error: máximo de suscriptores alcanzado.");
-                }
-                return;
-            }
-        } 
+// Función para descartar todo lo pendiente de la bandeja de salida de un cliente
+void clear_outbox(Client *client) {
+    for (int l = 0; l < LANES; l++) {
+        client->lanes[l].len = 0;
+        client->lanes[l].stamp_head = 0;
+        client->lanes[l].stamp_count = 0;
+        client->lanes[l].skipped = 0;
     }
+    client->outbox_len = 0;
+    client->split_lane = -1;
 }
 
-// Función para desuscribir un usuario de un topico
-void unsubscribe_topic(const char *topic_name, const char *client_pipe, const char *username) {
-    // Recorre todos los tópicos para encontrar el tópico al que el usuario desea desuscribirse
-    for (int i = 0; i < topic_count; i++) {
-        // Verifica si el nombre del tópico coincide con el tópico que el usuario quiere desuscribirse
-        if (strcmp(topics[i].name, topic_name) == 0) {
-            
-            // Recorre los suscriptores del tópico
-            for (int j = 0; j < topics[i].subscriber_count; j++) {
-                
-                // Verifica si el usuario está suscrito a este tópico
-                if (strcmp(topics[i].subscribers[j], username) == 0) {
-                    
-                    // Si el usuario está suscrito, lo elimina de la lista de suscriptores del tópico
-                    // Empezamos desde el índice del suscriptor y recorre los suscriptores detrás de él
-                    for (int k = j; k < topics[i].subscriber_count - 1; k++) {
-                        // Desplaza los suscriptores restantes una posición hacia atrás para sobrescribir al usuario eliminado
-                        // Se copia el suscriptor siguiente en la posición donde estaba el suscriptor eliminado y hace lo mismo con los demás
-                        strncpy(topics[i].subscribers[k], topics[i].subscribers[k + 1], USERNAME_LEN);
-                    }
-                    
-                    // Disminuye el contador de suscriptores para reflejar la eliminación
-                    topics[i].subscriber_count--;
-                    
-                    // Envia una respuesta al cliente confirmando que se desuscribió correctamente
-                    send_response(client_pipe, "Te has desuscrito del tópico.");
-                    return;
-                }
-            }
-
-            // Si el usuario no estaba suscrito al tópico, envía una respuesta al cliente
-            send_response(client_pipe, "No estás suscrito al tópico.");
-            return;
+// Función para preparar la escritura de la bandeja de un cliente: primero el resto de un mensaje a medio
+// escribir, luego los carriles que han cedido starvation_writes escrituras seguidas y después el resto por prioridad
+void plan_write(Client *client) {
+    client->iov_count = 0;
+    size_t skip[LANES] = { 0 };
+    if (client->split_lane != -1) {
+        // Sin terminar ese mensaje el cliente no podría separar los siguientes
+        Lane *lane = &client->lanes[client->split_lane];
+        char *end = memchr(lane->data, '\0', lane->len);
+        skip[client->split_lane] = end != NULL ? (size_t)(end - lane->data) + 1 : lane->len;
+        client->iov[0].iov_base = lane->data;
+        client->iov[0].iov_len = skip[client->split_lane];
+        client->iov_lane[0] = client->split_lane;
+        client->iov_count = 1;
+    }
+    int order[LANES], count = 0, starved[LANES] = { 0 };
+    for (int l = LANE_HIGH; l < LANES; l++) {
+        if (client->lanes[l].len > skip[l] && client->lanes[l].skipped >= starvation_writes) {
+            starved[l] = 1;
+            order[count++] = l;
         }
     }
-
-    // Si no se encuentra el tópico en la lista, se envía una respuesta indicando que el tópico no existe
-    send_response(client_pipe, "El tópico no existe.");
-}
-
-
-// Función para listar los topicos
-void list_topics(const char *client_pipe) {
-    char response[1024] = "Tópicos:\n";
-
-    if (topic_count == 0) {
-        // Concatenar "No hay tópicos para listar." a response
-        strcat(response, "No hay tópicos para listar.\n");
-        printf("No hay tópicos para listar.\n");
-    } else {
-        // Construir la lista de tópicos
-        for (int i = 0; i < topic_count; i++) {
-            char topic_info[100];
-            snprintf(topic_info, sizeof(topic_info), "- %s (Suscriptores: %d)\n", topics[i].name, topics[i].subscriber_count);
-            strcat(response, topic_info);
+    if (count > 0) {
+        local_stats->promotions++;
+    }
+    for (int l = 0; l < LANES; l++) {
+        if (!starved[l]) {
+            order[count++] = l;
+        }
+    }
+    for (int o = 0; o < LANES; o++) {
+        Lane *lane = &client->lanes[order[o]];
+        if (lane->len > skip[order[o]]) {
+            client->iov[client->iov_count].iov_base = lane->data + skip[order[o]];
+            client->iov[client->iov_count].iov_len = lane->len - skip[order[o]];
+            client->iov_lane[client->iov_count] = order[o];
+            client->iov_count++;
         }
-        printf("Se listaron %d tópicos.\n", topic_count);
     }
-
-    // Enviar la respuesta completa usando response
-    send_response(client_pipe, response);
 }
 
-
-// Función para verificar si un tópico existe
-int topic_exists(const char *topic_name) {  
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].name, topic_name) == 0) {
-            return 1;
+// Función para abrir la pipe de un cliente la primera vez que se le entrega algo, devuelve -1 si no se puede escribir
+int open_client_pipe(Client *client) {
+    // La pipe se abre una vez y se mantiene abierta; sin lector la apertura falla con ENXIO
+    if (client->fd == -1) {
+        client->fd = open(client->client_pipe, O_WRONLY | O_NONBLOCK);
+        if (client->fd == -1) {
+            if (errno == ENXIO || errno == ENOENT) {
+                client->is_dead = 1;
+                clear_outbox(client);
+            } else {
+                perror("Error al abrir la pipe del cliente");
+            }
+            return -1;
         }
     }
     return 0;
 }
 
-// Función para listar los usuarios conectados
-void list_connected_users() {
-    if (client_count == 0) {
-        printf("No hay usuarios conectados.\n");
+// Función para aplicar el resultado de una escritura en la pipe de un cliente (bytes escritos o -errno),
+// común a write y a io_uring
+void client_written(int index, ssize_t written, int reason) {
+    Client *client = &clients[index];
+    if (written < 0) {
+        errno = -written;
+        if (errno == EAGAIN) {
+            client->is_blocked = 1; // pipe llena: se reintenta cuando haga sitio (retry_blocked_clients)
+        } else if (errno == EPIPE) {
+            client->is_dead = 1; // el lector desapareció
+            clear_outbox(client);
+        } else {
+            perror("Error al escribir en la pipe del cliente");
+            client->is_blocked = 1; // se reintenta cuando haga sitio en vez de en cada vuelta
+        }
         return;
     }
+    local_stats->flushes[reason]++;
 
-    for (int i = 0; i < client_count; i++) {
-        printf("- %s (Pipe: %s)\n", clients[i].username, clients[i].client_pipe);
+    // Repartir los bytes escritos entre los carriles en el orden de la escritura preparada
+    size_t consumed[LANES] = { 0 };
+    size_t remaining = written;
+    client->split_lane = -1;
+    for (int k = 0; k < client->iov_count && remaining > 0; k++) {
+        int l = client->iov_lane[k];
+        size_t part = remaining < client->iov[k].iov_len ? remaining : client->iov[k].iov_len;
+        consumed[l] += part;
+        remaining -= part;
+        if (part < client->iov[k].iov_len && client->lanes[l].data[consumed[l] - 1] != '\0') {
+            client->split_lane = l; // escritura parcial en mitad de un mensaje
+        }
     }
-}
-
-// Función para enviar un mensaje a un topico
-void send_message(Response* request) {
-    // Verificar si el tópico existe
-    int topic_index = -1;
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].name, request->topic) == 0) {
-            topic_index = i;
-            break;
+    // Un carril que tenía mensajes y no avanzó mientras avanzaba otro de más prioridad ha cedido la escritura
+    int first_advanced = LANES;
+    for (int l = LANES - 1; l >= 0; l--) {
+        if (consumed[l] > 0) {
+            first_advanced = l;
         }
     }
+    long now = monotonic_us();
+    for (int l = 0; l < LANES; l++) {
+        Lane *lane = &client->lanes[l];
+        if (consumed[l] == 0) {
+            if (lane->len > 0 && first_advanced < l) {
+                lane->skipped++;
+            }
+            continue;
+        }
+        lane->skipped = 0;
 
-    // Si el tópico no existe, crearlo
-    if (topic_index == -1) {
-        if (topic_count < MAX_TOPICS) {
-            // Inicializar el nuevo tópico
-            strncpy(topics[topic_count].name, request->topic, TOPIC_NAME_LEN);
-            topics[topic_count].name[TOPIC_NAME_LEN - 1] = '\0';
-            topics[topic_count].subscriber_count = 0; // Sin suscriptores iniciales
-            topics[topic_count].is_locked = 0;       // No bloqueado por defecto
-            topics[topic_count].has_active_messages = 0; // Sin mensajes activos inicialmente
-
-            topic_index = topic_count;
-            topic_count++;
+        // Cada mensaje terminado de escribir suma su espera en la bandeja a la del carril
+        char *end = lane->data + consumed[l];
+        for (char *p = lane->data; (p = memchr(p, '\0', end - p)) != NULL; p++) {
+            unsigned long waited = now - lane->stamps[lane->stamp_head++];
+            local_stats->lane_delivered[l]++;
+            local_stats->lane_wait_us[l] += waited;
+            if (waited > local_stats->lane_wait_max_us[l]) {
+                local_stats->lane_wait_max_us[l] = waited;
+            }
+        }
+        if (lane->stamp_head == lane->stamp_count) {
+            lane->stamp_head = 0;
+            lane->stamp_count = 0;
+        }
 
-            printf("Tópico '%s' creado automáticamente.\n", request->topic);
-        } else {
-            send_response(request->client_pipe, "Error: No se pueden crear más tópicos, límite alcanzado.");
-            return;
+        lane->len -= consumed[l];
+        if (lane->len > 0) {
+            memmove(lane->data, lane->data + consumed[l], lane->len);
         }
     }
 
-    // Verificar si el tópico está bloqueado
-    if (topics[topic_index].is_locked) {
-        send_response(request->client_pipe, "El tópico está bloqueado. No se puede enviar el mensaje.");
+    // Escritura parcial: el cliente reconstruye los mensajes partidos, el resto queda pendiente
+    client->outbox_len -= written;
+    client->is_blocked = client->outbox_len > 0;
+}
+
+// Función para entregar de una sola vez todos los mensajes pendientes de un cliente, por orden de carril
+void flush_client(int index, int reason) {
+    Client *client = &clients[index];
+    if (client->outbox_len == 0 || client->is_dead) {
         return;
     }
 
+    // En la reproducción de una traza las entregas se descartan como si se hubieran escrito
+    if (replay_mode) {
+        local_stats->writes++;
+        local_stats->flushes[reason]++;
+        clear_outbox(client);
+        return;
+    }
 
-    // Si el mensaje es persistente, verificar el número de mensajes persistentes en el tópico
-    if (request->lifetime > 0) {
-        int persistent_message_count = 0;
+    if (open_client_pipe(client) == -1) {
+        return;
+    }
+    plan_write(client);
+    ssize_t written = writev(client->fd, client->iov, client->iov_count);
+    local_stats->writes++;
+    local_stats->syscalls++;
+    client_written(index, written == -1 ? -errno : written, reason);
+}
 
-        // Contar los mensajes persistentes en el tópico
-        for (int i = 0; i < message_count; i++) {
-            if (strcmp(messages[i].topic, request->topic) == 0 && messages[i].lifetime > 0) {
-                persistent_message_count++;
-            }
+// Función para vaciar las bandejas de los clientes de una parte que no tienen la pipe llena
+void flush_clients_part(int reason, int part, int parts) {
+    for (int i = part; i < client_count; i += parts) {
+        if (clients[i].outbox_len > 0 && !clients[i].is_blocked) {
+            flush_client(i, reason);
         }
+    }
+}
 
-        // Verificar si se ha alcanzado el límite de 5 mensajes persistentes
-        if (persistent_message_count >= 5) {
-            send_response(request->client_pipe, "Error: Se ha alcanzado el límite de 5 mensajes persistentes en este tópico.");
-            return;
+// Función para comprobar que el núcleo admite escrituras sin espera (RWF_NOWAIT) en pipes con nombre con
+// io_uring (algunos solo las admiten en pipes anónimas). Sin ellas una escritura en una pipe llena espera
+// en un hilo del núcleo y bloquea todas las entregas
+int uring_probe_nowait(Uring *ring) {
+    char probe_pipe[80];
+    snprintf(probe_pipe, sizeof(probe_pipe), "%s.probe", server_pipe_path);
+    unlink(probe_pipe);
+    if (mkfifo(probe_pipe, 0600) == -1) {
+        return -1;
+    }
+    int fds[2];
+    fds[0] = open(probe_pipe, O_RDONLY | O_NONBLOCK);
+    fds[1] = fds[0] == -1 ? -1 : open(probe_pipe, O_WRONLY | O_NONBLOCK);
+    unlink(probe_pipe);
+    if (fds[1] == -1) {
+        if (fds[0] != -1) {
+            close(fds[0]);
         }
+        return -1;
     }
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fds[1];
+    sqe->addr = (uint64_t)(uintptr_t)"";
+    sqe->len = 1;
+    sqe->off = (uint64_t)-1;
+    sqe->rw_flags = RWF_NOWAIT;
+    int result = -1;
+    if (uring_submit(ring, 1) != -1) {
+        struct io_uring_cqe *cqe = uring_peek(ring);
+        result = cqe != NULL && cqe->res == 1 ? 0 : -1;
+        if (cqe != NULL) {
+            uring_seen(ring);
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return result;
+}
+
+// Función para esperar las escrituras enviadas a io_uring y aplicar sus resultados
+void uring_complete_writes(unsigned count, int reason) {
+    local_stats->syscalls++;
+    if (uring_submit(&delivery_ring, count) == -1 && errno != EINTR) {
+        perror("Error al enviar las escrituras a io_uring");
+    }
+    for (unsigned done = 0; done < count; ) {
+        struct io_uring_cqe *cqe = uring_peek(&delivery_ring);
+        if (cqe == NULL) {
+            local_stats->syscalls++;
+            uring_submit(&delivery_ring, count - done); // la espera se interrumpió con una señal
+            continue;
+        }
+        client_written((int)cqe->user_data, cqe->res, reason);
+        uring_seen(&delivery_ring);
+        done++;
+    }
+}
+
+// Función para vaciar las bandejas de todos los clientes con una sola llamada a io_uring por cada
+// URING_ENTRIES clientes. Las bandejas no se tocan hasta que terminan todas las escrituras
+void uring_flush_clients(int reason) {
+    unsigned queued = 0;
+    for (int i = 0; i < client_count; i++) {
+        Client *client = &clients[i];
+        if (client->outbox_len == 0 || client->is_blocked || client->is_dead) {
+            continue;
+        }
+        if (replay_mode) {
+            flush_client(i, reason);
+            continue;
+        }
+        if (open_client_pipe(client) == -1) {
+            continue;
+        }
+        struct io_uring_sqe *sqe = uring_sqe(&delivery_ring);
+        if (sqe == NULL) {
+            uring_complete_writes(queued, reason);
+            queued = 0;
+            sqe = uring_sqe(&delivery_ring);
+        }
+        plan_write(client);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = client->fd;
+        sqe->addr = (uint64_t)(uintptr_t)client->iov;
+        sqe->len = client->iov_count;
+        sqe->off = (uint64_t)-1; // las pipes no tienen posición
+        sqe->rw_flags = RWF_NOWAIT; // con la pipe llena devuelve EAGAIN en vez de esperar en un hilo del núcleo
+        sqe->user_data = i;
+        local_stats->writes++;
+        queued++;
+    }
+    if (queued > 0) {
+        uring_complete_writes(queued, reason);
+    }
+}
+
+void fanout_run(int kind, const int *targets, int target_count, const char *message, int lane, int reason);
+
+// Función para vaciar las bandejas de todos los clientes que no tienen la pipe llena
+void flush_all_clients(int reason) {
+    if (fanout_threads > 0 && client_count >= fanout_min_width) {
+        fanout_run(FANOUT_FLUSH, NULL, 0, NULL, 0, reason); // muchas escrituras: se reparten entre los hilos
+    } else if (delivery_ring.fd != -1) {
+        uring_flush_clients(reason);
+    } else {
+        flush_clients_part(reason, 0, 1);
+    }
+}
+
+// Función para obtener la antigüedad en microsegundos del mensaje pendiente más antiguo (-1 si no hay)
+long oldest_pending_us() {
+    long oldest = -1;
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].outbox_len > 0 && !clients[i].is_blocked && !clients[i].is_dead) {
+            long age = elapsed_us(&clients[i].oldest_pending);
+            if (age > oldest) {
+                oldest = age;
+            }
+        }
+    }
+    return oldest;
+}
+
+// Función para obtener la espera entre reintentos a los clientes con la pipe llena: la latencia máxima de
+// agrupación, pero nunca menos de BLOCKED_RETRY_MIN_US para no dar vueltas sin esperar mientras siguen llenas
+long blocked_retry_us() {
+    return max_batch_latency_us > BLOCKED_RETRY_MIN_US ? max_batch_latency_us : BLOCKED_RETRY_MIN_US;
+}
+
+// Función para reintentar las entregas a los clientes con la pipe llena cuyo lector ya ha hecho sitio
+// (POLLOUT), como mucho una vez cada blocked_retry_us(). Así un cliente que se atascó una vez
+// no espera a la siguiente pasada del lifetime. Devuelve los clientes que siguen bloqueados
+int retry_blocked_clients() {
+    static struct timespec last_retry;
+    struct pollfd pfds[MAX_USERS];
+    int indexes[MAX_USERS];
+    int count = 0;
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].is_blocked && !clients[i].is_dead && clients[i].fd != -1) {
+            pfds[count].fd = clients[i].fd;
+            pfds[count].events = POLLOUT;
+            indexes[count++] = i;
+        }
+    }
+    if (count == 0 || elapsed_us(&last_retry) < blocked_retry_us()) {
+        return count;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &last_retry);
+    local_stats->syscalls++;
+    if (poll(pfds, count, 0) <= 0) {
+        return count;
+    }
+    int still_blocked = count;
+    for (int k = 0; k < count; k++) {
+        if (pfds[k].revents != 0) {
+            clients[indexes[k]].is_blocked = 0;
+            flush_client(indexes[k], FLUSH_RETRY);
+            still_blocked -= !clients[indexes[k]].is_blocked;
+        }
+    }
+    return still_blocked;
+}
+
+// Función para encolar un mensaje en un carril de la bandeja de salida de un cliente, devuelve -1 si se descarta
+int send_to_client(int index, const char *message, int lane_index) {
+    Client *client = &clients[index];
+    if (client->is_dead) {
+        return -1;
+    }
+    size_t len = strlen(message) + 1; // +1 para incluir el carácter nulo
+    Lane *lane = &client->lanes[lane_index];
+
+    // Guardar el momento de encolado; el espacio de los ya entregados se reutiliza antes de crecer
+    if (lane->stamp_count == lane->stamp_cap && lane->stamp_head > 0) {
+        lane->stamp_count -= lane->stamp_head;
+        memmove(lane->stamps, lane->stamps + lane->stamp_head, lane->stamp_count * sizeof(long));
+        lane->stamp_head = 0;
+    }
+    if (lane->stamp_count == lane->stamp_cap) {
+        size_t capacity = lane->stamp_cap > 0 ? lane->stamp_cap * 2 : 64;
+        long *grown = realloc(lane->stamps, capacity * sizeof(long));
+        if (grown == NULL) {
+            local_stats->dropped++;
+            printf("Bandeja de salida de '%s' llena: mensaje descartado.\n", client->username);
+            return -1;
+        }
+        lane->stamps = grown;
+        lane->stamp_cap = capacity;
+    }
+
+    // Cada carril tiene su propio límite: una ráfaga de un tópico no hace descartar los avisos de control
+    if (lane->len + len > lane->cap) {
+        size_t capacity = lane->cap > 0 ? lane->cap : 4096;
+        while (capacity < lane->len + len) {
+            capacity *= 2;
+        }
+        char *grown = capacity <= OUTBOX_LIMIT ? realloc(lane->data, capacity) : NULL;
+        if (grown == NULL) {
+            local_stats->dropped++;
+            printf("Bandeja de salida de '%s' llena: mensaje descartado.\n", client->username);
+            return -1;
+        }
+        lane->data = grown;
+        lane->cap = capacity;
+    }
+
+    if (client->outbox_len == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &client->oldest_pending);
+    }
+    lane->stamps[lane->stamp_count++] = monotonic_us();
+    memcpy(lane->data + lane->len, message, len);
+    lane->len += len;
+    client->outbox_len += len;
+    local_stats->frames++;
+    local_stats->lane_frames[lane_index]++;
+
+    // Lote completo: se entrega sin esperar
+    if (client->outbox_len >= batch_max_bytes && !client->is_blocked) {
+        flush_client(index, FLUSH_SIZE);
+    }
+    return 0;
+}
+
+// Función para enviar un mensaje a la pipe de un cliente en un carril, devuelve -1 si no se pudo entregar
+int send_to_pipe(const char *client_pipe, const char *message, int lane) {
+    // Los clientes conectados reciben los mensajes agrupados a través de su bandeja de salida
+    for (int i = 0; i < client_count; i++) {
+        if (strcmp(clients[i].client_pipe, client_pipe) == 0) {
+            return send_to_client(i, message, lane);
+        }
+    }
+
+    if (replay_mode) {
+        local_stats->writes++;
+        local_stats->frames++;
+        return 0;
+    }
+
+    // Pipe que no pertenece a ningún cliente conectado (inicio de sesión rechazado): entrega directa.
+    // La apertura no bloqueante falla con ENXIO si el cliente ya no tiene la pipe abierta,
+    // en lugar de bloquear al manager para siempre con el mutex cogido
+    int fd = open(client_pipe, O_WRONLY | O_NONBLOCK);
+    if (fd == -1) {
+        if (errno != ENXIO && errno != ENOENT) {
+            perror("Error al abrir la pipe del cliente");
+        }
+        return -1;
+    }
+
+    // Con un lector presente la escritura vuelve a ser bloqueante; si el lector desaparece devuelve EPIPE
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    ssize_t written = write(fd, message, strlen(message) + 1); // +1 para incluir el carácter nulo
+    local_stats->writes++;
+    local_stats->frames++;
+    local_stats->syscalls += 5; // open, fcntl (2), write y close
+    close(fd);
+    return written == -1 ? -1 : 0;
+}
+
+// Función para enviar una respuesta o un aviso a un cliente por el carril de control
+int send_response(const char *client_pipe, const char *message) {
+    return send_to_pipe(client_pipe, message, LANE_CONTROL);
+}
+
+// Función para hacer una parte de un trabajo de reparto: cada cliente pertenece a una sola parte,
+// así sus mensajes se encolan y escriben siempre en orden
+void fanout_part(int part, int parts) {
+    FanoutPool *pool = &fanout_pool;
+    if (pool->kind == FANOUT_FLUSH) {
+        flush_clients_part(pool->reason, part, parts);
+        return;
+    }
+    for (int t = 0; t < pool->target_count; t++) {
+        if (pool->targets[t] % parts == part) {
+            send_to_client(pool->targets[t], pool->message, pool->lane);
+        }
+    }
+}
+
+// Función para sumar unas estadísticas de entrega a las globales y ponerlas a cero
+void merge_delivery_stats(DeliveryStats *stats) {
+    delivery_stats.frames += stats->frames;
+    delivery_stats.writes += stats->writes;
+    for (int r = 0; r < FLUSH_REASONS; r++) {
+        delivery_stats.flushes[r] += stats->flushes[r];
+    }
+    delivery_stats.dropped += stats->dropped;
+    delivery_stats.syscalls += stats->syscalls;
+    for (int l = 0; l < LANES; l++) {
+        delivery_stats.lane_frames[l] += stats->lane_frames[l];
+        delivery_stats.lane_delivered[l] += stats->lane_delivered[l];
+        delivery_stats.lane_wait_us[l] += stats->lane_wait_us[l];
+        if (stats->lane_wait_max_us[l] > delivery_stats.lane_wait_max_us[l]) {
+            delivery_stats.lane_wait_max_us[l] = stats->lane_wait_max_us[l];
+        }
+    }
+    delivery_stats.promotions += stats->promotions;
+    memset(stats, 0, sizeof(DeliveryStats));
+}
+
+// Función de los hilos de reparto: esperan un trabajo, hacen su parte y avisan al terminar
+void *fanout_worker(void *arg) {
+    FanoutWorker *worker = arg;
+    FanoutPool *pool = &fanout_pool;
+    local_stats = &worker->stats;
+
+    // Los hilos se crean entre dos trabajos: cualquier generación distinta de la de su arranque es un trabajo pendiente
+    unsigned long seen = worker->seen;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->generation == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        fanout_part(worker->part, fanout_threads + 1);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Función para repartir un trabajo entre los hilos de reparto y el hilo actual, vuelve cuando todos terminan
+void fanout_run(int kind, const int *targets, int target_count, const char *message, int lane, int reason) {
+    FanoutPool *pool = &fanout_pool;
+    pthread_mutex_lock(&pool->lock);
+    pool->kind = kind;
+    pool->targets = targets;
+    pool->target_count = target_count;
+    pool->message = message;
+    pool->lane = lane;
+    pool->reason = reason;
+    pool->pending = fanout_threads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    fanout_part(fanout_threads, fanout_threads + 1); // la última parte la hace el hilo que publica
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int w = 0; w < fanout_threads; w++) {
+        merge_delivery_stats(&fanout_workers[w].stats);
+    }
+}
+
+// Función para arrancar los hilos de reparto (por defecto uno menos que los núcleos disponibles)
+void start_fanout_workers() {
+    if (fanout_threads < 0) {
+        fanout_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    }
+    if (fanout_threads > MAX_FANOUT_THREADS) {
+        fanout_threads = MAX_FANOUT_THREADS;
+    }
+    fanout_pool.shutdown = 0; // se pueden volver a arrancar tras stop_fanout_workers
+    for (int w = 0; w < fanout_threads; w++) {
+        fanout_workers[w].part = w;
+        fanout_workers[w].seen = fanout_pool.generation;
+        if (pthread_create(&fanout_workers[w].thread, NULL, fanout_worker, &fanout_workers[w]) != 0) {
+            perror("Error al crear los hilos de reparto");
+            fanout_threads = w; // se reparte con los que se hayan creado
+            break;
+        }
+    }
+}
+
+// Función para terminar los hilos de reparto
+void stop_fanout_workers() {
+    pthread_mutex_lock(&fanout_pool.lock);
+    fanout_pool.shutdown = 1;
+    pthread_cond_broadcast(&fanout_pool.start);
+    pthread_mutex_unlock(&fanout_pool.lock);
+    for (int w = 0; w < fanout_threads; w++) {
+        pthread_join(fanout_workers[w].thread, NULL);
+    }
+    fanout_threads = 0;
+}
+
+// Función para inicializar la cola de persistencia
+void persist_queue_init(PersistQueue *queue) {
+    atomic_store(&queue->stub.next, NULL);
+    atomic_store(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+}
+
+// Función para encolar un registro (segura desde cualquier hilo, sin bloqueos)
+void persist_queue_push(PersistQueue *queue, PersistRecord *record) {
+    atomic_store(&record->next, NULL);
+    PersistRecord *prev = atomic_exchange(&queue->head, record);
+    atomic_store(&prev->next, record);
+}
+
+// Función para extraer el registro más antiguo (solo desde el hilo de persistencia), NULL si no hay
+PersistRecord *persist_queue_pop(PersistQueue *queue) {
+    PersistRecord *tail = queue->tail;
+    PersistRecord *next = atomic_load(&tail->next);
+
+    // Saltar el nodo auxiliar
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = atomic_load(&next->next);
+    }
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    // Un productor está a medio encolar: se reintenta en la siguiente vuelta
+    if (tail != atomic_load(&queue->head)) {
+        return NULL;
+    }
+
+    // Último registro: volver a colocar el nodo auxiliar detrás para poder extraerlo
+    persist_queue_push(queue, &queue->stub);
+    next = atomic_load(&tail->next);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Función para comprobar sin extraer nada si la cola está vacía (solo el consumidor). Un productor a medio
+// encolar ya ha movido head, así que la cola no se da por vacía hasta que termine y avise con el semáforo
+int persist_queue_empty(PersistQueue *queue) {
+    return queue->tail == &queue->stub && atomic_load(&queue->stub.next) == NULL && atomic_load(&queue->head) == &queue->stub;
+}
+
+// Función para enviar un registro al hilo de persistencia (el texto pasa a ser propiedad del hilo)
+void persist_enqueue(int kind, char *data, size_t len, const char *ack_pipe) {
+    // El manager en espera no escribe: el archivo es del principal hasta que tome el relevo
+    if (standby_mode) {
+        free(data);
+        return;
+    }
+    PersistRecord *record = malloc(sizeof(PersistRecord));
+    if (record == NULL) {
+        perror("Error al reservar memoria para la persistencia");
+        free(data);
+        return;
+    }
+    record->kind = kind;
+    record->data = data;
+    record->len = len;
+    record->ack_pipe[0] = '\0';
+    if (ack_pipe != NULL) {
+        strncpy(record->ack_pipe, ack_pipe, sizeof(record->ack_pipe) - 1);
+        record->ack_pipe[sizeof(record->ack_pipe) - 1] = '\0';
+    }
+    persist_queue_push(&persist_queue, record);
+    sem_post(&persist_sem);
+}
+
+// Función para enviar una señal al proceso de un cliente (nunca durante la reproducción de una traza)
+void signal_client(pid_t pid, int sig) {
+    if (!replay_mode && pid > 0) {
+        kill(pid, sig);
+    }
+}
+
+// Función para cerrar un cliente rechazado dándole tiempo a leer el motivo
+void reject_client(pid_t pid) {
+    if (!replay_mode) {
+        sleep(1);
+        signal_client(pid, SIGTERM);
+    }
+}
+
+// Función para empezar a grabar los comandos recibidos en un archivo de traza
+int trace_open(const char *path) {
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL) {
+        perror("Error al abrir el archivo de traza");
+        return -1;
+    }
+    uint32_t version = TRACE_VERSION;
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file);
+    fwrite(&version, sizeof(version), 1, trace_file);
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    printf("Grabando los comandos recibidos en '%s'.\n", path);
+    return 0;
+}
+
+// Función para escribir un registro: marca de tiempo, origen, campos numéricos y solo los bytes usados de cada texto
+void write_record(FILE *file, uint64_t timestamp, int kind, const Response *msg) {
+    const char *texts[5] = { msg->client_pipe, msg->topic, msg->username, msg->message, msg->key };
+    size_t sizes[5] = { sizeof(msg->client_pipe), sizeof(msg->topic), sizeof(msg->username), sizeof(msg->message), sizeof(msg->key) };
+    uint16_t lengths[5];
+    for (int i = 0; i < 5; i++) {
+        lengths[i] = strnlen(texts[i], sizes[i] - 1);
+    }
+    uint8_t origin = kind;
+    int32_t numbers[4] = { msg->command_type, msg->pid, msg->lifetime, (int32_t)msg->session };
+
+    fwrite(&timestamp, sizeof(timestamp), 1, file);
+    fwrite(&origin, sizeof(origin), 1, file);
+    fwrite(numbers, sizeof(numbers), 1, file);
+    fwrite(lengths, sizeof(lengths), 1, file);
+    for (int i = 0; i < 5; i++) {
+        fwrite(texts[i], 1, lengths[i], file);
+    }
+}
+
+// Función para grabar un comando en la traza (tiempo relativo al inicio) y en el registro de replicación
+// (tiempo absoluto del reloj monotónico, común a todos los procesos de la máquina)
+void trace_record(int kind, const Response *msg) {
+    if (trace_file == NULL && repl_file == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file != NULL && kind != TRACE_HEARTBEAT) {
+        uint64_t timestamp = (uint64_t)(now.tv_sec - trace_start.tv_sec) * 1000000000ULL + (now.tv_nsec - trace_start.tv_nsec);
+        write_record(trace_file, timestamp, kind, msg);
+    }
+    if (repl_file != NULL) {
+        write_record(repl_file, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec, kind, msg);
+        replication_stats.records++;
+        repl_changes += kind != TRACE_HEARTBEAT;
+        if (kind != TRACE_CLIENT) {
+            fflush(repl_file); // los comandos de clientes se vuelcan por lotes desde el bucle principal
+        }
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+// Función para volcar al registro de replicación los comandos grabados
+void repl_flush() {
+    if (repl_file == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&trace_mutex);
+    fflush(repl_file);
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+// Función para grabar la eliminación de la sesión de un cliente muerto
+void trace_reap(const char *username) {
+    Response msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command_type = -1;
+    snprintf(msg.username, sizeof(msg.username), "%s", username);
+    trace_record(TRACE_REAP, &msg);
+}
+
+// Función del hilo de latidos: el manager en espera mide con ellos el retraso y detecta un principal colgado
+void *repl_heartbeat(void *arg) {
+    Response beat;
+    memset(&beat, 0, sizeof(beat));
+    beat.command_type = -1;
+    beat.pid = getpid();
+    while (!repl_shutdown) {
+        usleep(REPL_HEARTBEAT_MS * 1000);
+        trace_record(TRACE_HEARTBEAT, &beat);
+    }
+    return NULL;
+}
+
+// Función para abrir el registro de replicación: el cerrojo sobre el archivo indica que el principal vive
+int repl_open(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("Error al abrir el registro de replicación");
+        return -1;
+    }
+    if (flock(fileno(file), LOCK_EX | LOCK_NB) == -1) {
+        printf("Otro manager ya escribe el registro de replicación '%s'.\n", path);
+        fclose(file);
+        return -1;
+    }
+    uint32_t version = TRACE_VERSION;
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), file);
+    fwrite(&version, sizeof(version), 1, file);
+    fflush(file);
+    repl_file = file;
+    snprintf(repl_log_path, sizeof(repl_log_path), "%s", path);
+    if (pthread_create(&repl_thread, NULL, repl_heartbeat, NULL) != 0) {
+        perror("Error al crear el hilo de latidos");
+        return -1;
+    }
+    printf("Replicando el estado en '%s'.\n", path);
+    return 0;
+}
+
+// Función para cerrar el registro de replicación (libera el cerrojo)
+void repl_close() {
+    if (repl_file == NULL) {
+        return;
+    }
+    repl_shutdown = 1;
+    pthread_join(repl_thread, NULL);
+    pthread_mutex_lock(&trace_mutex);
+    fclose(repl_file);
+    repl_file = NULL;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+// Función para grabar un comando del administrador (el texto va en el campo del mensaje)
+void trace_admin(const char *input) {
+    if (trace_file == NULL && repl_file == NULL) {
+        return;
+    }
+    Response msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.command_type = -1;
+    strncpy(msg.message, input, sizeof(msg.message) - 1);
+    trace_record(TRACE_ADMIN, &msg);
+}
+
+// Función para terminar la grabación de la traza
+void trace_close() {
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file != NULL) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+// Función para leer el siguiente comando de una traza, devuelve 0 al llegar al final
+int trace_read(FILE *file, uint64_t *timestamp, int *kind, Response *msg) {
+    uint8_t origin;
+    int32_t numbers[4];
+    uint16_t lengths[5];
+    if (fread(timestamp, sizeof(*timestamp), 1, file) != 1 ||
+        fread(&origin, sizeof(origin), 1, file) != 1 ||
+        fread(numbers, sizeof(numbers), 1, file) != 1 ||
+        fread(lengths, sizeof(lengths), 1, file) != 1) {
+        return 0;
+    }
+    memset(msg, 0, sizeof(Response));
+    *kind = origin;
+    msg->command_type = numbers[0];
+    msg->pid = numbers[1];
+    msg->lifetime = numbers[2];
+    msg->session = (uint32_t)numbers[3];
+
+    char *texts[5] = { msg->client_pipe, msg->topic, msg->username, msg->message, msg->key };
+    size_t sizes[5] = { sizeof(msg->client_pipe), sizeof(msg->topic), sizeof(msg->username), sizeof(msg->message), sizeof(msg->key) };
+    for (int i = 0; i < 5; i++) {
+        if (lengths[i] >= sizes[i] || fread(texts[i], 1, lengths[i], file) != lengths[i]) {
+            return 0; // traza corrupta o truncada
+        }
+    }
+    return 1;
+}
+
+// Función para eliminar todos los usuarios conectados y cerrar el manager (close y CTRL+C del manager)
+void close_all_connections() {
+    // Cerrar todas las conexiones de clientes
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].pid > 0) {
+            signal_client(clients[i].pid, SIGTERM); // Enviar SIGTERM al cliente
+            printf("Se envió SIGTERM a %s (PID: %d)\n", clients[i].username, clients[i].pid);
+        }
+    }
+
+    // Enviar SIGUSR1 a los hilos
+    if (lifetime_thread_started) {
+        pthread_kill(lifetime_thread, SIGUSR1);  // Solicitar a lifetime_thread que se cierre
+    }
+    if (command_thread_started) {
+        pthread_kill(command_thread, SIGUSR1);   // Solicitar a command_thread que se cierre
+    }
+
+    // Esperar a que los hilos terminen correctamente
+    if (lifetime_thread_started) {
+        pthread_join(lifetime_thread, NULL);
+        printf("Lifetime thread finalizado.\n");
+    }
+
+    if (command_thread_started) {
+        pthread_join(command_thread, NULL);
+        printf("Command thread finalizado.\n");
+    }
+
+    // Vaciar la cola de persistencia antes de salir
+    persist_shutdown = 1;
+    sem_post(&persist_sem);
+    pthread_join(persist_thread, NULL);
+    printf("Persist thread finalizado.\n");
+
+    stop_fanout_workers();
+    trace_close();
+    repl_close();
+}
+
+
+// Función para manejar la señal SIGINT (CTRL+C) del programa
+void handle_sigint(int sig) {
+    printf("\nServidor finalizado. Limpiando recursos...\n");
+    trace_admin("close"); // un cierre ordenado no debe provocar el relevo del manager en espera
+    close_all_connections();
+    unlink(server_pipe_path);
+    exit(0); 
+}
+
+
+// Función para configurar un cubo de tokens (rate 0 elimina el límite)
+void set_rate_limit(RateLimit *bucket, double rate, double burst) {
+    bucket->rate = rate > 0 ? rate : 0;
+    bucket->burst = burst >= 1 ? burst : 1;
+    bucket->tokens = bucket->burst; // el cubo empieza lleno
+    bucket->rejected = 0;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last_refill);
+}
+
+// Función para recargar los tokens según el tiempo transcurrido y comprobar si hay uno disponible (O(1))
+int rate_limit_allows(RateLimit *bucket) {
+    if (bucket->rate == 0) {
+        return 1; // sin límite
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - bucket->last_refill.tv_sec) + (now.tv_nsec - bucket->last_refill.tv_nsec) / 1e9;
+    bucket->last_refill = now;
+
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    if (bucket->tokens < 1) {
+        bucket->rejected++;
+        return 0;
+    }
+    return 1;
+}
+
+// Función para gastar el token de un envío admitido
+void rate_limit_consume(RateLimit *bucket) {
+    if (bucket->rate > 0) {
+        bucket->tokens -= 1;
+    }
+}
+
+// Función para reservar memoria para un registro en la arena (alineada a 4 bytes)
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 3) & ~(size_t)3;
+    if (arena->head == NULL || arena->head->used + size > arena->head->capacity) {
+        size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + capacity);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        arena->head = chunk;
+        arena->chunk_count++;
+        arena->reserved += sizeof(ArenaChunk) + capacity;
+    }
+    void *ptr = arena->head->data + arena->head->used;
+    arena->head->used += size;
+    arena->used += size;
+    return ptr;
+}
+
+// Función para liberar de una vez todos los bloques de una arena
+void arena_release(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    memset(arena, 0, sizeof(Arena));
+}
+
+// Función hash de cadenas (FNV-1a)
+uint32_t hash_string(const char *str) {
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 16777619u;
+    }
+    return hash;
+}
+
+// Función para inicializar la tabla de nombres
+void init_names() {
+    for (int i = 0; i < NAME_BUCKETS; i++) {
+        name_buckets[i] = -1;
+    }
+}
+
+// Función para obtener el identificador de un nombre añadiéndolo si no existe (suma una referencia), -1 si está llena
+int intern_name(const char *name) {
+    int bucket = hash_string(name) & (NAME_BUCKETS - 1);
+    for (int id = name_buckets[bucket]; id != -1; id = name_table[id].next) {
+        if (strcmp(name_table[id].name, name) == 0) {
+            name_table[id].refs++;
+            return id;
+        }
+    }
+    if (name_count >= MAX_NAMES) {
+        return -1;
+    }
+    int id = 0;
+    while (name_table[id].name != NULL) {
+        id++; // primera entrada libre
+    }
+    name_table[id].name = strdup(name);
+    if (name_table[id].name == NULL) {
+        return -1;
+    }
+    name_table[id].refs = 1;
+    name_table[id].next = name_buckets[bucket];
+    name_buckets[bucket] = id;
+    name_count++;
+    return id;
+}
+
+// Función para buscar el identificador de un nombre sin añadirlo, devuelve -1 si no existe
+int find_name(const char *name) {
+    int bucket = hash_string(name) & (NAME_BUCKETS - 1);
+    for (int id = name_buckets[bucket]; id != -1; id = name_table[id].next) {
+        if (strcmp(name_table[id].name, name) == 0) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+// Función para quitar una referencia a un nombre y liberarlo cuando ningún mensaje lo usa
+void release_name(int id) {
+    if (--name_table[id].refs > 0) {
+        return;
+    }
+    int *link = &name_buckets[hash_string(name_table[id].name) & (NAME_BUCKETS - 1)];
+    while (*link != id) {
+        link = &name_table[*link].next;
+    }
+    *link = name_table[id].next;
+    free(name_table[id].name);
+    name_table[id].name = NULL;
+    name_count--;
+}
+
+// Función para obtener el nombre asociado a un identificador
+const char *name_of(int id) {
+    return name_table[id].name;
+}
+
+// Función para calcular el tamaño en la arena de un registro
+size_t record_size(const MessageRecord *record) {
+    return sizeof(MessageRecord) + record->length + 1;
+}
+
+// Función para guardar un mensaje persistente en la arena, devuelve el registro o NULL si no hay espacio
+// (key es la clave del mensaje, vacía si no tiene)
+MessageRecord *store_message(const char *topic, const char *sender, const char *key, int lifetime, const char *text, time_t created) {
+    if (message_count >= MAX_MESSAGES) {
+        return NULL;
+    }
+    int topic_id = intern_name(topic);
+    if (topic_id == -1) {
+        return NULL;
+    }
+    int sender_id = intern_name(sender);
+    if (sender_id == -1) {
+        release_name(topic_id);
+        return NULL;
+    }
+    int key_id = key[0] != '\0' ? intern_name(key) : NO_KEY;
+    if (key_id == -1) {
+        release_name(topic_id);
+        release_name(sender_id);
+        return NULL;
+    }
+
+    size_t length = strnlen(text, TAM_MSG - 1);
+    MessageRecord *record = arena_alloc(&message_arena, sizeof(MessageRecord) + length + 1);
+    if (record == NULL) {
+        release_name(topic_id);
+        release_name(sender_id);
+        if (key_id != NO_KEY) {
+            release_name(key_id);
+        }
+        return NULL;
+    }
+    record->created = created;
+    record->lifetime = lifetime;
+    record->topic_id = topic_id;
+    record->sender_id = sender_id;
+    record->length = length;
+    record->key_id = key_id;
+    memcpy(record->text, text, length);
+    record->text[length] = '\0';
+
+    messages[message_count++] = record;
+    return record;
+}
+
+// Función para compactar los mensajes: copia los vivos a una arena nueva y libera la anterior de una vez
+void compact_messages() {
+    Arena fresh = { 0 };
+    int live = 0;
+    for (int i = 0; i < message_count; i++) {
+        MessageRecord *record = messages[i];
+        if (record->lifetime <= 0) {
+            // Mensaje caducado: solo hay que soltar sus nombres, su memoria se libera con la arena
+            release_name(record->topic_id);
+            release_name(record->sender_id);
+            if (record->key_id != NO_KEY) {
+                release_name(record->key_id);
+            }
+            continue;
+        }
+        MessageRecord *copy = arena_alloc(&fresh, record_size(record));
+        if (copy == NULL) {
+            perror("Error al reservar memoria para compactar los mensajes");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(copy, record, record_size(record));
+        messages[live++] = copy;
+    }
+    arena_release(&message_arena);
+    message_arena = fresh;
+    message_count = live;
+}
+
+// Función para describir un tópico, común al listado de tópicos y a los cambios del directorio
+void format_topic_entry(const Topic *topic, char *buf, size_t size) {
+    int length = snprintf(buf, size, "%s (Suscriptores: %d", topic->name, topic->subscriber_count);
+    if (topic->group_count > 0) {
+        length += snprintf(buf + length, size - length, ", Grupos: %d", topic->group_count);
+    }
+    if (topic->is_locked) {
+        length += snprintf(buf + length, size - length, ", bloqueado");
+    }
+    snprintf(buf + length, size - length, ")");
+}
+
+// Función para avisar de un cambio del directorio de tópicos (creado, eliminado, bloqueado, desbloqueado
+// o cambiado) a los clientes que lo vigilan. Cada cambio lleva su número de secuencia para que el cliente
+// descarte los que ya estaban incluidos en su instantánea
+void directory_event(const char *event, const Topic *topic) {
+    directory_seq++;
+    if (directory_watchers == 0) {
+        return; // sin clientes vigilando, un cambio solo cuesta el contador
+    }
+
+    char entry[128];
+    char notification[256];
+    if (strcmp(event, "eliminado") == 0) {
+        snprintf(entry, sizeof(entry), "%s", topic->name);
+    } else {
+        format_topic_entry(topic, entry, sizeof(entry));
+    }
+    snprintf(notification, sizeof(notification), "Directorio #%llu: %s %s", directory_seq, event, entry);
+    for (int k = 0; k < client_count; k++) {
+        if (clients[k].watches_directory) {
+            send_to_client(k, notification, LANE_CONTROL);
+        }
+    }
+}
+
+// Función para crear un tópico vacío, devuelve su índice o -1 si se alcanzó el límite
+int create_topic(const char *topic_name) {
+    if (topic_count >= MAX_TOPICS) {
+        return -1;
+    }
+    // Limpiar los restos de un tópico eliminado anteriormente en esa posición
+    memset(&topics[topic_count], 0, sizeof(Topic));
+    topics[topic_count].lane = LANE_NORMAL;
+    strncpy(topics[topic_count].name, topic_name, TOPIC_NAME_LEN);
+    topics[topic_count].name[TOPIC_NAME_LEN - 1] = '\0';
+    directory_event("creado", &topics[topic_count]);
+    return topic_count++;
+}
+
+// Función para buscar el índice de un tópico, devuelve -1 si no existe
+int find_topic(const char *topic_name) {
+    for (int i = 0; i < topic_count; i++) {
+        if (strcmp(topics[i].name, topic_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Función para reconstruir la tabla hash de usuarios conectados (tras desplazar la lista de clientes)
+void index_clients() {
+    for (int b = 0; b < CLIENT_BUCKETS; b++) {
+        client_buckets[b] = -1;
+    }
+    for (int i = 0; i < client_count; i++) {
+        int bucket = hash_string(clients[i].username) & (CLIENT_BUCKETS - 1);
+        clients[i].next_in_bucket = client_buckets[bucket];
+        client_buckets[bucket] = i;
+        sessions[clients[i].session].client = i;
+    }
+}
+
+// Función para buscar el índice de un cliente conectado, devuelve -1 si no existe
+int find_client(const char *username) {
+    int bucket = hash_string(username) & (CLIENT_BUCKETS - 1);
+    for (int i = client_buckets[bucket]; i != -1; i = clients[i].next_in_bucket) {
+        if (strcmp(clients[i].username, username) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Función para inicializar la tabla de sesiones con todos los huecos libres
+void init_sessions() {
+    for (int i = 0; i < MAX_USERS; i++) {
+        sessions[i].generation = 1;
+        sessions[i].client = -1;
+        free_sessions[i] = MAX_USERS - 1 - i; // se reparten primero los huecos bajos
+    }
+    free_session_count = MAX_USERS;
+}
+
+// Función para abrir la sesión de un cliente, devuelve su identificador
+uint32_t open_session(int index) {
+    int slot = free_sessions[--free_session_count]; // hay hueco: hay tantos como clientes posibles
+    sessions[slot].client = index;
+    clients[index].session = slot;
+    return SESSION_TOKEN(slot, sessions[slot].generation);
+}
+
+// Función para abrir la sesión de un cliente con un identificador ya entregado por el principal (hueco y
+// generación), devuelve ese identificador o uno nuevo si el hueco no es válido o está ocupado
+uint32_t claim_session(int index, uint32_t token) {
+    uint32_t slot = token & 0xFFFF;
+    if (slot >= MAX_USERS || token >> 16 == 0 || sessions[slot].client != -1) {
+        printf("Sesión %u no disponible: se entrega otra.\n", token);
+        return open_session(index);
+    }
+    for (int i = 0; i < free_session_count; i++) {
+        if (free_sessions[i] == (int)slot) {
+            free_sessions[i] = free_sessions[--free_session_count];
+            break;
+        }
+    }
+    sessions[slot].client = index;
+    sessions[slot].generation = token >> 16;
+    clients[index].session = slot;
+    return token;
+}
+
+// Función para cerrar la sesión de un cliente: cambia la generación para que su identificador deje de valer
+void close_session(int index) {
+    Session *session = &sessions[clients[index].session];
+    session->client = -1;
+    if (++session->generation == 0) {
+        session->generation = 1;
+    }
+    free_sessions[free_session_count++] = clients[index].session;
+}
+
+// Función para obtener en O(1) el cliente de un identificador de sesión, devuelve -1 si no es válido o ha caducado
+int resolve_session(uint32_t token) {
+    uint32_t slot = token & 0xFFFF;
+    if (slot >= MAX_USERS || sessions[slot].client == -1 || sessions[slot].generation != token >> 16) {
+        return -1;
+    }
+    return sessions[slot].client;
+}
+
+// Función para escribir un mensaje retenido como línea del archivo de mensajes ("lifetime@clave" si tiene clave)
+int format_persist_line(char *line, const char *topic, const char *sender, int lifetime, const char *key, const char *text) {
+    if (key[0] != '\0') {
+        return sprintf(line, "%s %s %d@%s %s\n", topic, sender, lifetime, key, text);
+    }
+    return sprintf(line, "%s %s %d %s\n", topic, sender, lifetime, text);
+}
+
+// Función para buscar el hueco de una clave en la tabla de últimos valores de un tópico compactado
+MessageRecord **latest_slot(Topic *topic, int key_id) {
+    unsigned slot = ((unsigned)key_id * 2654435761u) >> (32 - KEY_SLOT_BITS);
+    while (topic->latest[slot] != NULL && topic->latest[slot]->key_id != key_id) {
+        slot = (slot + 1) & (KEY_SLOTS - 1);
+    }
+    return &topic->latest[slot];
+}
+
+// Función para descartar un mensaje retenido sustituido por otro de su clave: deja de escribirse en el
+// archivo y su memoria se recupera en la siguiente compactación de la arena
+void supersede_message(MessageRecord *record) {
+    record->lifetime = 0;
+    superseded_messages++;
+}
+
+// Función para dejar en el índice de un tópico compactado solo el último mensaje de cada clave y
+// reconstruir su tabla de últimos valores
+void compact_topic_index(Topic *topic) {
+    memset(topic->latest, 0, sizeof(topic->latest));
+    int kept = topic->message_index_count;
+    // Del más reciente al más antiguo: el primero que aparece de cada clave es su último valor
+    for (int j = topic->message_index_count - 1; j >= 0; j--) {
+        MessageRecord *record = topic->message_index[j];
+        if (record->key_id != NO_KEY) {
+            MessageRecord **slot = latest_slot(topic, record->key_id);
+            if (*slot != NULL) {
+                supersede_message(record);
+                continue;
+            }
+            *slot = record;
+        }
+        topic->message_index[--kept] = record;
+    }
+    topic->message_index_count -= kept;
+    memmove(topic->message_index, topic->message_index + kept, topic->message_index_count * sizeof(MessageRecord *));
+}
+
+// Función para reconstruir el índice de mensajes persistentes de cada tópico tras compactar messages[]
+void rebuild_topic_indexes() {
+    for (int i = 0; i < topic_count; i++) {
+        topics[i].message_index_count = 0;
+    }
+    for (int j = 0; j < message_count; j++) {
+        if (messages[j]->lifetime <= 0) {
+            continue;
+        }
+        int i = find_topic(name_of(messages[j]->topic_id));
+        if (i != -1) {
+            topics[i].message_index[topics[i].message_index_count++] = messages[j];
+        }
+    }
+    for (int i = 0; i < topic_count; i++) {
+        if (topics[i].is_compacted) {
+            compact_topic_index(&topics[i]); // las direcciones de los mensajes han cambiado
+        }
+        topics[i].has_active_messages = topics[i].message_index_count > 0;
+    }
+}
+
+// Función para escribir la línea con la que se reenvía un mensaje retenido a un suscriptor nuevo
+int format_replay_line(char *line, size_t size, const char *topic_name, const MessageRecord *stored) {
+    if (stored->key_id != NO_KEY) {
+        return snprintf(line, size, "%s %s key=%s %s\n", topic_name, name_of(stored->sender_id), name_of(stored->key_id), stored->text);
+    }
+    return snprintf(line, size, "%s %s %s\n", topic_name, name_of(stored->sender_id), stored->text);
+}
+
+// Función para entrenar el diccionario de un tópico comprimido con las líneas más recientes de sus mensajes
+// retenidos. Se entrena una sola vez: cambiarlo obligaría a reenviarlo a todos los clientes que ya lo tienen
+void train_dictionary(Topic *topic) {
+    char line[PERSIST_LINE_MAX];
+    int start = LZ_DICT_SIZE;
+    // Del más reciente al más antiguo, llenando el diccionario desde el final
+    for (int j = topic->message_index_count - 1; j >= 0 && start > 0; j--) {
+        int length = format_replay_line(line, sizeof(line), topic->name, topic->message_index[j]);
+        int take = length < start ? length : start;
+        start -= take;
+        memcpy(topic->dictionary + start, line + length - take, take);
+    }
+    topic->dictionary_len = LZ_DICT_SIZE - start;
+    memmove(topic->dictionary, topic->dictionary + start, topic->dictionary_len);
+    topic->dictionary_id = topic->dictionary_len > 0 ? lz_dictionary_id(topic->dictionary, topic->dictionary_len) : 0;
+}
+
+// Función para reenviar comprimidos los mensajes retenidos de un tópico a un suscriptor que lo admite,
+// precedidos de su diccionario si el cliente no tiene ya esa versión. Devuelve -1 si no compensa comprimirlos
+int send_compressed_replay(int k, const Topic *topic, const char *text, size_t length, uint32_t cached) {
+    char compressed[LZ_FRAME_MAX];
+    char frame[LZ_FRAME_MAX + LZ_FRAME_MAX / 254 + 128];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int size = lz_compress(topic->dictionary, topic->dictionary_len, text, length, compressed, sizeof(compressed));
+    compression_stats.replay_ns += elapsed_ns(&start);
+    // Si el cliente no tiene el diccionario, su envío cuenta como parte del reenvío
+    size_t cost = (size_t)size + size / 254 + 64;
+    if (cached != topic->dictionary_id) {
+        cost += topic->dictionary_len + topic->dictionary_len / 254 + 64;
+    }
+    if (size == -1 || cost >= length) {
+        compression_stats.replay_skipped++;
+        return -1;
+    }
+
+    // El diccionario va antes por el mismo carril: el cliente ya lo tiene cuando llega el reenvío
+    if (cached != topic->dictionary_id) {
+        int n = snprintf(frame, sizeof(frame), LZ_DICT_TAG "%s %u ", topic->name, topic->dictionary_id);
+        n += cobs_encode(topic->dictionary, topic->dictionary_len, frame + n, 0);
+        frame[n] = '\0';
+        send_to_client(k, frame, topic->lane);
+        compression_stats.dictionary_sends++;
+        compression_stats.dictionary_bytes += n;
+        compression_stats.replay_bytes += n;
+    }
+
+    int n = snprintf(frame, sizeof(frame), LZ_FRAME_TAG "%s %u %zu ", topic->name, topic->dictionary_id, length);
+    n += cobs_encode(compressed, size, frame + n, 0); // sin nulos: cada mensaje de la pipe termina en nulo
+    frame[n] = '\0';
+    send_to_client(k, frame, topic->lane);
+    compression_stats.replay_blocks++;
+    compression_stats.replay_raw_bytes += length;
+    compression_stats.replay_bytes += n;
+    return 0;
+}
+
+// Función para escribir en el archivo los mensajes retenidos de un tópico comprimido: una línea con su
+// diccionario (así el tópico sigue comprimido y con el mismo diccionario al reiniciar) y otra con las
+// líneas de sus mensajes comprimidas. Si el diccionario y el bloque juntos no ocupan menos que las líneas,
+// se escriben las líneas tal cual tras una marca de tópico comprimido. Devuelve los bytes escritos en out
+size_t format_compressed_topic(const Topic *topic, char *out) {
+    char raw[MAX_MESSAGES * PERSIST_LINE_MAX];
+    char compressed[MAX_MESSAGES * PERSIST_LINE_MAX];
+    int raw_len = 0;
+    for (int j = 0; j < topic->message_index_count; j++) {
+        const MessageRecord *record = topic->message_index[j];
+        raw_len += format_persist_line(raw + raw_len, topic->name, name_of(record->sender_id), record->lifetime,
+                                       record->key_id != NO_KEY ? name_of(record->key_id) : "", record->text);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int size = topic->dictionary_len > 0 ?
+               lz_compress(topic->dictionary, topic->dictionary_len, raw, raw_len, compressed, sizeof(compressed)) : -1;
+    compression_stats.disk_ns += elapsed_ns(&start);
+    if (size == -1 || size + size / 254 + 64 + topic->dictionary_len + topic->dictionary_len / 254 + 64 >= raw_len) {
+        size_t len = sprintf(out, COMPRESS_DISK_TAG "%s\n", topic->name);
+        memcpy(out + len, raw, raw_len);
+        compression_stats.disk_skipped++;
+        return len + raw_len;
+    }
+
+    // Codificadas con COBS las líneas de datos no contienen saltos de línea
+    size_t len = sprintf(out, LZ_DISK_DICT_TAG "%s %u ", topic->name, topic->dictionary_id);
+    len += cobs_encode(topic->dictionary, topic->dictionary_len, out + len, '\n');
+    out[len++] = '\n';
+    len += sprintf(out + len, LZ_DISK_TAG "%s %u %d ", topic->name, topic->dictionary_id, raw_len);
+    len += cobs_encode(compressed, size, out + len, '\n');
+    out[len++] = '\n';
+    compression_stats.disk_blocks++;
+    compression_stats.disk_raw_bytes += raw_len;
+    compression_stats.disk_bytes += len;
+    return len;
+}
+
+// Función para añadir un usuario a la lista de usuarios conectados con el identificador de sesión dado, o
+// con uno nuevo si es 0 (devuelve el identificador de su sesión, o 0 si no se ha agregado)
+uint32_t add_client(const char *client_pipe, const char *username, pid_t pid, uint32_t session) {
+    // Verificar si el cliente ya está conectado
+    int existing = find_client(username);
+    if (existing != -1) {
+        printf("El cliente %s ya está conectado (PID: %d)\n", username, clients[existing].pid);
+        return 0; // No agregar el cliente nuevamente
+    }
+
+    // Si no está, añadir el cliente
+    if (client_count < MAX_USERS) {
+        strncpy(clients[client_count].client_pipe, client_pipe, sizeof(clients[client_count].client_pipe) - 1);
+        strncpy(clients[client_count].username, username, USERNAME_LEN);
+        clients[client_count].pid = pid;
+        clients[client_count].is_dead = 0;
+        clients[client_count].fd = -1;
+        memset(clients[client_count].lanes, 0, sizeof(clients[client_count].lanes)); // el hueco puede contener una copia de un cliente desplazado
+        clear_outbox(&clients[client_count]);
+        clients[client_count].is_blocked = 0;
+        clients[client_count].watches_directory = 0;
+        clients[client_count].accepts_compressed = 0;
+        set_rate_limit(&clients[client_count].limit, default_client_limit.rate, default_client_limit.burst);
+        int bucket = hash_string(username) & (CLIENT_BUCKETS - 1);
+        clients[client_count].next_in_bucket = client_buckets[bucket];
+        client_buckets[bucket] = client_count;
+        uint32_t token = session != 0 ? claim_session(client_count, session) : open_session(client_count);
+        client_count++;
+        printf("Cliente agregado: %s (PID: %d, sesión %u)\n", username, pid, token);
+        return token;
+    } else {
+        printf("No se puede agregar el cliente %s. Límite máximo de usuarios alcanzado.\n", username);
+        return 0;
+    }
+}
+
+// Función para buscar un texto dentro de otro. Con SSE2 compara a la vez 16 posiciones con el primer
+// y el último carácter del patrón y solo confirma con memcmp las posiciones candidatas
+const char *find_substring(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+    if (pattern_length == 0) {
+        return text;
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[pattern_length - 1]);
+    for (; i + pattern_length + 15 <= length; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(text + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(text + i + pattern_length - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                        _mm_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(text + i + bit, pattern, pattern_length) == 0) {
+                return text + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    // Posiciones finales (o todas sin SSE2)
+    for (; i + pattern_length <= length; i++) {
+        if (text[i] == pattern[0] && memcmp(text + i, pattern, pattern_length) == 0) {
+            return text + i;
+        }
+    }
+    return NULL;
+}
+
+// Función para interpretar un filtro "sender|contains|prefix <texto>", devuelve -1 si no es válido
+int parse_filter(const char *predicate, int *kind, char *text) {
+    static const char *names[] = { "sender ", "contains ", "prefix " };
+    for (int k = 0; k < 3; k++) {
+        size_t name_length = strlen(names[k]);
+        if (strncmp(predicate, names[k], name_length) == 0) {
+            const char *value = predicate + name_length;
+            if (*value == '\0' || strlen(value) >= FILTER_LEN) {
+                return -1;
+            }
+            *kind = k;
+            strcpy(text, value);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Función para obtener el filtro de un tópico con ese predicado, compartiéndolo si ya existe (-1 si no caben más)
+int acquire_filter(Topic *topic, int kind, const char *text) {
+    int free_slot = -1;
+    for (int f = 0; f < MAX_FILTERS; f++) {
+        if (topic->filters[f].refs == 0) {
+            if (free_slot == -1) {
+                free_slot = f;
+            }
+        } else if (topic->filters[f].kind == kind && strcmp(topic->filters[f].text, text) == 0) {
+            topic->filters[f].refs++;
+            return f;
+        }
+    }
+    if (free_slot != -1) {
+        TopicFilter *filter = &topic->filters[free_slot];
+        filter->kind = kind;
+        strcpy(filter->text, text);
+        filter->length = strlen(text);
+        filter->refs = 1;
+    }
+    return free_slot;
+}
+
+// Función para comprobar si un mensaje cumple un filtro
+int filter_matches(const TopicFilter *filter, const char *sender, const char *text, size_t length) {
+    switch (filter->kind) {
+        case FILTER_SENDER:
+            return strcmp(sender, filter->text) == 0;
+        case FILTER_PREFIX:
+            return length >= filter->length && memcmp(text, filter->text, filter->length) == 0;
+        default:
+            return find_substring(text, length, filter->text, filter->length) != NULL;
+    }
+}
+
+// Función para quitar a un suscriptor de un tópico soltando su filtro
+void remove_subscriber(Topic *topic, int j) {
+    if (topic->subscriber_filters[j] != -1) {
+        topic->filters[topic->subscriber_filters[j]].refs--;
+    }
+    for (int k = j; k < topic->subscriber_count - 1; k++) {
+        strncpy(topic->subscribers[k], topic->subscribers[k + 1], USERNAME_LEN);
+        topic->subscriber_filters[k] = topic->subscriber_filters[k + 1];
+    }
+    topic->subscriber_count--;
+    directory_event("cambiado", topic);
+}
+
+// Función para comprobar si un usuario es miembro de algún grupo de consumidores de un tópico
+int in_any_group(const Topic *topic, const char *username) {
+    for (int g = 0; g < topic->group_count; g++) {
+        for (int m = 0; m < topic->groups[g].member_count; m++) {
+            if (strcmp(topic->groups[g].members[m], username) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Función para suscribir un usuario a un topico y recibir los mensajes de ese topico
+// (predicate es un filtro opcional "sender|contains|prefix <texto>", vacío para recibirlos todos)
+void subscribe_topic(const char *topic_name, const char *client_pipe, const char *username, const char *predicate, uint32_t dictionary) {
+    if (strlen(topic_name) >= TOPIC_NAME_LEN) {
+        send_response(client_pipe, "Error: El nombre del tópico excede el máximo de caracteres.");
+        return;
+    }
+
+    int filter_kind = -1;
+    char filter_text[FILTER_LEN];
+    if (predicate[0] != '\0' && parse_filter(predicate, &filter_kind, filter_text) == -1) {
+        send_response(client_pipe, "Error: filtro no válido (sender, contains o prefix seguido de un texto).");
+        return;
+    }
+
+    // Comprobar si se ha alcanzado el límite de tópicos
+    if (topic_count >= MAX_TOPICS) {
+        send_response(client_pipe, "Error: máximo de tópicos alcanzado.");
+        return;
+    }
+
+    // Buscar si el tópico ya existe
+    int topic_index = -1;
+    for (int i = 0; i < topic_count; i++) {
+        if (strcmp(topics[i].name, topic_name) == 0) {
+            topic_index = i;
+            break;
+        }
+    }
+
+    // Si no existe el topico, crear uno nuevo y agregar al primer suscriptor
+    if (topic_index == -1) {
+        topic_index = create_topic(topic_name);
+
+        // Agregar el primer suscriptor (el usuario que se suscribe)
+        strncpy(topics[topic_index].subscribers[0], username, USERNAME_LEN);
+        topics[topic_index].subscriber_filters[0] = filter_kind == -1 ? -1 : acquire_filter(&topics[topic_index], filter_kind, filter_text);
+        topics[topic_index].subscriber_count++;
+        directory_event("cambiado", &topics[topic_index]);
+
+        // Imprimir mensaje en el servidor
+        printf("El usuario '%s' ha creado y se ha suscrito al tópico '%s'.\n", username, topic_name);
+
+        // Enviar respuesta al cliente
+        send_response(client_pipe, "Tópico creado y suscrito.");
+
+    }
+    else{
+        // Buscar el tópico en la lista de tópicos
+        for (int i = 0; i < topic_count; i++) {
+            if (strcmp(topics[i].name, topic_name) == 0) {
+                // Verificar si el usuario ya está suscrito
+                for (int j = 0; j < topics[i].subscriber_count; j++) {
+                    if (strcmp(topics[i].subscribers[j], username) == 0) {
+                        send_response(client_pipe, "Ya estás suscrito al tópico.");
+                        return;
+                    }
+                }
+                // Un miembro de un grupo ya recibe su parte de los mensajes: suscribirlo también los duplicaría
+                if (in_any_group(&topics[i], username)) {
+                    send_response(client_pipe, "Error: ya perteneces a un grupo de este tópico.");
+                    return;
+                }
+
+                // Si el usuario no está suscrito, agregarlo
+                int filter = -1;
+                if (filter_kind != -1 && (filter = acquire_filter(&topics[i], filter_kind, filter_text)) == -1) {
+                    send_response(client_pipe, "Error: máximo de filtros distintos alcanzado en el tópico.");
+                    return;
+                }
+                if (topics[i].subscriber_count < MAX_SUBSCRIBERS) {
+                    strncpy(topics[i].subscribers[topics[i].subscriber_count], username, USERNAME_LEN);
+                    topics[i].subscribers[topics[i].subscriber_count][USERNAME_LEN - 1] = '\0';
+                    topics[i].subscriber_filters[topics[i].subscriber_count] = filter;
+                    topics[i].subscriber_count++;
+                    directory_event("cambiado", &topics[i]);
+
+                    // Imprimir mensaje en el servidor
+                    printf("El usuario '%s' se ha suscrito al tópico '%s'.\n", username, topic_name);
+
+                    // Almacenar los mensajes persistentes del tópico en una lista (buffer) usando su índice
+                    char all_messages[1024 * MAX_MESSAGES];  // Suponiendo un límite de mensajes
+                    size_t length = 0;
+                    all_messages[0] = '\0';
+                    for (int j = 0; j < topics[i].message_index_count; j++) {
+                        MessageRecord *stored = topics[i].message_index[j];
+                        if (filter != -1 && !filter_matches(&topics[i].filters[filter], name_of(stored->sender_id), stored->text, stored->length)) {
+                            continue;
+                        }
+                        length += format_replay_line(all_messages + length, sizeof(all_messages) - length, topic_name, stored);
+                        if (length >= sizeof(all_messages)) {
+                            length = sizeof(all_messages) - 1;
+                            break;
+                        }
+                    }
+
+                    // Enviar todos los mensajes de una vez, comprimidos si el tópico lo está y el cliente lo admite
+                    int k = find_client(username);
+                    if (length > 0 && (!topics[i].is_compressed || k == -1 || !clients[k].accepts_compressed ||
+                                       send_compressed_replay(k, &topics[i], all_messages, length, dictionary) == -1)) {
+                        send_to_pipe(client_pipe, all_messages, topics[i].lane);
+                    }
+
+                    // Informar a los suscriptores actuales del tópico
+                    printf("Usuarios suscritos al tópico '%s':\n", topic_name);
+                    for (int j = 0; j < topics[i].subscriber_count; j++) {
+                        printf(" - %s\n", topics[i].subscribers[j]);
+                    }
+
+                    send_response(client_pipe, "Te has suscrito al tópico.");
+                } else {
+                    if (filter != -1) {
+                        topics[i].filters[filter].refs--;
+                    }
+                    send_response(client_pipe, "Error: máximo de suscriptores alcanzado.");
+                }
+                return;
+            }
+        } 
+    }
+}
+
+// Función para obtener los bytes pendientes de un cliente: su bandeja de salida y lo que aún no leyó de su pipe
+int client_queue_depth(int index) {
+    int pending = 0;
+    if (clients[index].fd == -1 || ioctl(clients[index].fd, FIONREAD, &pending) == -1) {
+        pending = 0;
+    }
+    return pending + (int)clients[index].outbox_len;
+}
+
+// Función para mostrar en el servidor el reparto actual de un grupo de consumidores
+void print_group_members(const char *topic_name, ConsumerGroup *group) {
+    printf("Grupo '%s' del tópico '%s' (%d miembros):\n", group->name, topic_name, group->member_count);
+    for (int i = 0; i < group->member_count; i++) {
+        printf(" - %s\n", group->members[i]);
+    }
+}
+
+// Función para unir un usuario a un grupo de consumidores de un tópico
+void subscribe_group(const char *topic_name, const char *group_name, int policy, const char *client_pipe, const char *username) {
+    if (strlen(topic_name) >= TOPIC_NAME_LEN) {
+        send_response(client_pipe, "Error: El nombre del tópico excede el máximo de caracteres.");
+        return;
+    }
+    if (group_name[0] == '\0' || strlen(group_name) >= GROUP_NAME_LEN) {
+        send_response(client_pipe, "Error: Nombre de grupo no válido.");
+        return;
+    }
+
+    // Buscar el tópico o crearlo si no existe
+    int topic_index = find_topic(topic_name);
+    if (topic_index == -1) {
+        topic_index = create_topic(topic_name);
+        if (topic_index == -1) {
+            send_response(client_pipe, "Error: máximo de tópicos alcanzado.");
+            return;
+        }
+        printf("Tópico '%s' creado automáticamente.\n", topic_name);
+    }
+    Topic *topic = &topics[topic_index];
+
+    // Un usuario solo puede pertenecer a un grupo por tópico
+    if (in_any_group(topic, username)) {
+        send_response(client_pipe, "Ya perteneces a un grupo de este tópico.");
+        return;
+    }
+    // Ni unirse a un grupo de un tópico al que ya está suscrito: recibiría cada mensaje dos veces
+    for (int j = 0; j < topic->subscriber_count; j++) {
+        if (strcmp(topic->subscribers[j], username) == 0) {
+            send_response(client_pipe, "Error: ya estás suscrito al tópico, cancela la suscripción antes de unirte a un grupo.");
+            return;
+        }
+    }
+
+    // Buscar el grupo o crearlo si no existe
+    ConsumerGroup *group = NULL;
+    int new_group = 0;
+    for (int g = 0; g < topic->group_count; g++) {
+        if (strcmp(topic->groups[g].name, group_name) == 0) {
+            group = &topic->groups[g];
+            break;
+        }
+    }
+    if (group == NULL) {
+        if (topic->group_count >= MAX_GROUPS) {
+            send_response(client_pipe, "Error: máximo de grupos alcanzado en el tópico.");
+            return;
+        }
+        group = &topic->groups[topic->group_count++];
+        new_group = 1;
+        memset(group, 0, sizeof(ConsumerGroup));
+        strncpy(group->name, group_name, GROUP_NAME_LEN - 1);
+        group->policy = policy;
+    }
+
+    if (group->member_count >= MAX_SUBSCRIBERS) {
+        send_response(client_pipe, "Error: máximo de miembros alcanzado en el grupo.");
+        return;
+    }
+
+    // Añadir el miembro; el reparto incluye al nuevo miembro a partir del siguiente mensaje
+    strncpy(group->members[group->member_count], username, USERNAME_LEN - 1);
+    group->members[group->member_count][USERNAME_LEN - 1] = '\0';
+    group->member_count++;
+    if (new_group) {
+        directory_event("cambiado", topic);
+    }
+
+    printf("El usuario '%s' se ha unido al grupo '%s' del tópico '%s'.\n", username, group_name, topic_name);
+    print_group_members(topic_name, group);
+
+    char response[128];
+    snprintf(response, sizeof(response), "Te has unido al grupo '%s' del tópico (%d miembros).", group->name, group->member_count);
+    send_response(client_pipe, response);
+}
+
+// Función para sacar a un usuario del grupo al que pertenece en un tópico, devuelve 1 si pertenecía a alguno
+int leave_group(int topic_index, const char *username) {
+    Topic *topic = &topics[topic_index];
+    for (int g = 0; g < topic->group_count; g++) {
+        ConsumerGroup *group = &topic->groups[g];
+        for (int m = 0; m < group->member_count; m++) {
+            if (strcmp(group->members[m], username) != 0) {
+                continue;
+            }
+
+            // Desplazar los miembros restantes para eliminar al usuario
+            for (int k = m; k < group->member_count - 1; k++) {
+                strncpy(group->members[k], group->members[k + 1], USERNAME_LEN);
+            }
+            group->member_count--;
+
+            // Reequilibrar el turno rotatorio para no saltarse a ningún miembro
+            if (m < group->next_member) {
+                group->next_member--;
+            }
+            if (group->next_member >= group->member_count) {
+                group->next_member = 0;
+            }
+
+            printf("El usuario '%s' ha salido del grupo '%s' del tópico '%s'.\n", username, group->name, topic->name);
+
+            // Eliminar el grupo si se ha quedado vacío
+            if (group->member_count == 0) {
+                for (int k = g; k < topic->group_count - 1; k++) {
+                    topic->groups[k] = topic->groups[k + 1];
+                }
+                topic->group_count--;
+                directory_event("cambiado", topic);
+            } else {
+                print_group_members(topic->name, group);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Función para sacar a un usuario de todos los grupos de consumidores (exit, remove y CTRL+C)
+void leave_all_groups(const char *username) {
+    for (int i = 0; i < topic_count; i++) {
+        leave_group(i, username);
+    }
+}
+
+// Función para eliminar a un usuario de todas sus suscripciones (tópicos y grupos de consumidores)
+void drop_subscriptions(const char *username) {
+    for (int i = 0; i < topic_count; i++) {
+        for (int j = 0; j < topics[i].subscriber_count; j++) {
+            if (strcmp(topics[i].subscribers[j], username) == 0) {
+                remove_subscriber(&topics[i], j);
+                break;
+            }
+        }
+        leave_group(i, username);
+    }
+}
+
+// Función para quitar un cliente de la lista de conectados desplazando los siguientes
+void drop_client(int index) {
+    // Liberar su pipe y los mensajes que no llegaron a entregarse
+    if (clients[index].fd != -1) {
+        close(clients[index].fd);
+    }
+    for (int l = 0; l < LANES; l++) {
+        free(clients[index].lanes[l].data);
+        free(clients[index].lanes[l].stamps);
+    }
+    close_session(index);
+    if (clients[index].watches_directory) {
+        directory_watchers--;
+    }
+    for (int j = index; j < client_count - 1; j++) {
+        clients[j] = clients[j + 1];
+    }
+    client_count--; // reducir el contador de clientes
+    index_clients(); // los índices han cambiado
+}
+
+// Función para elegir el miembro del grupo que recibe un mensaje, devuelve el índice del cliente o -1
+int pick_group_member(ConsumerGroup *group, const char *sender) {
+    int best_client = -1;
+    int best_member = -1;
+    int best_depth = 0;
+
+    // Recorrer los miembros empezando por el turno actual para repartir de forma equitativa
+    for (int n = 0; n < group->member_count; n++) {
+        int m = (group->next_member + n) % group->member_count;
+        if (strcmp(group->members[m], sender) == 0) {
+            continue; // evitar al remitente
+        }
+        int client_index = find_client(group->members[m]);
+        if (client_index == -1) {
+            continue; // miembro no conectado
+        }
+
+        if (group->policy == GROUP_ROUND_ROBIN) {
+            best_client = client_index;
+            best_member = m;
+            break;
+        }
+
+        // Menor cola: elegir el miembro con menos bytes pendientes
+        int depth = client_queue_depth(client_index);
+        if (best_client == -1 || depth < best_depth) {
+            best_client = client_index;
+            best_member = m;
+            best_depth = depth;
+            if (depth == 0) {
+                break; // no se puede mejorar
+            }
+        }
+    }
+
+    if (best_member != -1) {
+        group->next_member = (best_member + 1) % group->member_count;
+    }
+    return best_client;
+}
+
+// Función para enviar una notificación a todos los suscriptores y miembros de grupos de un tópico
+void notify_topic_subscribers(int topic_index, const char *notification) {
+    Topic *topic = &topics[topic_index];
+    for (int j = 0; j < topic->subscriber_count; j++) {
+        int k = find_client(topic->subscribers[j]);
+        if (k != -1) {
+            send_to_client(k, notification, LANE_CONTROL);
+        }
+    }
+    for (int g = 0; g < topic->group_count; g++) {
+        for (int m = 0; m < topic->groups[g].member_count; m++) {
+            int k = find_client(topic->groups[g].members[m]);
+            if (k != -1) {
+                send_to_client(k, notification, LANE_CONTROL);
+            }
+        }
+    }
+}
+
+// Función para desuscribir un usuario de un topico
+void unsubscribe_topic(const char *topic_name, const char *client_pipe, const char *username) {
+    // Recorre todos los tópicos para encontrar el tópico al que el usuario desea desuscribirse
+    for (int i = 0; i < topic_count; i++) {
+        // Verifica si el nombre del tópico coincide con el tópico que el usuario quiere desuscribirse
+        if (strcmp(topics[i].name, topic_name) == 0) {
+            
+            // Recorre los suscriptores del tópico
+            for (int j = 0; j < topics[i].subscriber_count; j++) {
+                
+                // Verifica si el usuario está suscrito a este tópico
+                if (strcmp(topics[i].subscribers[j], username) == 0) {
+                    
+                    // Si el usuario está suscrito, lo elimina de la lista de suscriptores del tópico
+                    // desplazando los suscriptores restantes una posición hacia atrás y suelta su filtro
+                    remove_subscriber(&topics[i], j);
+                    
+                    // Envia una respuesta al cliente confirmando que se desuscribió correctamente
+                    send_response(client_pipe, "Te has desuscrito del tópico.");
+                    return;
+                }
+            }
+
+            // Si el usuario pertenece a un grupo de consumidores del tópico, sale del grupo
+            if (leave_group(i, username)) {
+                send_response(client_pipe, "Has salido del grupo de consumidores del tópico.");
+                return;
+            }
+
+            // Si el usuario no estaba suscrito al tópico, envía una respuesta al cliente
+            send_response(client_pipe, "No estás suscrito al tópico.");
+            return;
+        }
+    }
+
+    // Si no se encuentra el tópico en la lista, se envía una respuesta indicando que el tópico no existe
+    send_response(client_pipe, "El tópico no existe.");
+}
+
+
+// Función para enviar la lista de tópicos en páginas de como mucho TOPIC_PAGE_SIZE bytes (en lugar de
+// truncarla), devuelve el número de páginas enviadas
+int send_topic_pages(const char *client_pipe, const char *header) {
+    char page[TOPIC_PAGE_SIZE];
+    int pages = 1;
+    size_t length = snprintf(page, sizeof(page), "%s", header);
+
+    if (topic_count == 0) {
+        snprintf(page + length, sizeof(page) - length, "No hay tópicos para listar.\n");
+    }
+    for (int i = 0; i < topic_count; i++) {
+        char entry[128];
+        char line[136];
+        format_topic_entry(&topics[i], entry, sizeof(entry));
+        size_t line_length = snprintf(line, sizeof(line), "- %s\n", entry);
+
+        // Página llena: se envía y la lista continúa en la siguiente
+        if (length + line_length >= sizeof(page)) {
+            send_response(client_pipe, page);
+            pages++;
+            length = snprintf(page, sizeof(page), "(página %d)\n", pages);
+        }
+        memcpy(page + length, line, line_length + 1);
+        length += line_length;
+    }
+    send_response(client_pipe, page);
+    return pages;
+}
+
+// Función para listar los topicos
+void list_topics(const char *client_pipe) {
+    char header[64] = "Tópicos:\n";
+    if (shard_count > 1) {
+        // Cada shard responde con sus tópicos; el cliente recibe una lista por shard
+        snprintf(header, sizeof(header), "Tópicos del shard %d/%d:\n", shard_index, shard_count);
+    }
+
+    int pages = send_topic_pages(client_pipe, header);
+    if (topic_count == 0) {
+        printf("No hay tópicos para listar.\n");
+    } else {
+        printf("Se listaron %d tópicos en %d páginas.\n", topic_count, pages);
+    }
+}
+
+// Función para que un cliente vigile el directorio de tópicos: recibe una instantánea paginada con el número
+// de secuencia actual y, a partir de ahí, solo los cambios posteriores
+void watch_directory(const char *client_pipe, int k) {
+    if (k == -1) {
+        send_response(client_pipe, "Error: usuario no conectado.");
+        return;
+    }
+    if (!clients[k].watches_directory) {
+        clients[k].watches_directory = 1;
+        directory_watchers++;
+    }
+
+    // Volver a pedirlo estando ya vigilando sirve para resincronizar el catálogo
+    char header[96];
+    if (shard_count > 1) {
+        snprintf(header, sizeof(header), "Directorio del shard %d/%d (secuencia %llu):\n", shard_index, shard_count, directory_seq);
+    } else {
+        snprintf(header, sizeof(header), "Directorio (secuencia %llu):\n", directory_seq);
+    }
+    send_topic_pages(client_pipe, header);
+    printf("El usuario '%s' vigila el directorio de tópicos (secuencia %llu).\n", clients[k].username, directory_seq);
+}
+
+// Función para dejar de vigilar el directorio de tópicos
+void unwatch_directory(const char *client_pipe, int k) {
+    if (k == -1 || !clients[k].watches_directory) {
+        send_response(client_pipe, "No estás vigilando el directorio de tópicos.");
+        return;
+    }
+    clients[k].watches_directory = 0;
+    directory_watchers--;
+    send_response(client_pipe, "Has dejado de vigilar el directorio de tópicos.");
+}
+
+
+// Función para verificar si un tópico existe
+int topic_exists(const char *topic_name) {  
+    for (int i = 0; i < topic_count; i++) {
+        if (strcmp(topics[i].name, topic_name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Función para listar los usuarios conectados
+void list_connected_users() {
+    if (client_count == 0) {
+        printf("No hay usuarios conectados.\n");
+        return;
+    }
+
+    for (int i = 0; i < client_count; i++) {
+        printf("- %s (Pipe: %s)", clients[i].username, clients[i].client_pipe);
+        if (clients[i].limit.rate > 0) {
+            printf(" [límite %.2f/s, ráfaga %.0f, rechazados %lu]", clients[i].limit.rate, clients[i].limit.burst, clients[i].limit.rejected);
+        }
+        printf("\n");
+    }
+}
+
+// Función para comprobar si un tópico admite un mensaje persistente más (el índice del tópico los cuenta).
+// Un tópico retiene como mucho TOPIC_RETAINED_LIMIT mensajes; en uno compactado los valores con clave no
+// cuentan para ese límite y solo se limita el número de claves distintas a COMPACTED_KEYS_LIMIT
+int has_retained_room(const Topic *topic, int keyed) {
+    if (!topic->is_compacted) {
+        return topic->message_index_count < TOPIC_RETAINED_LIMIT;
+    }
+    int keys = 0;
+    for (int j = 0; j < topic->message_index_count; j++) {
+        keys += topic->message_index[j]->key_id != NO_KEY;
+    }
+    return keyed ? keys < COMPACTED_KEYS_LIMIT : topic->message_index_count - keys < TOPIC_RETAINED_LIMIT;
+}
+
+// Función para enviar un mensaje a un topico (sender_index es el cliente que lo envía, -1 si no está conectado)
+void send_message(Response* request, int sender_index) {
+    // Verificar si el tópico existe
+    int topic_index = -1;
+    for (int i = 0; i < topic_count; i++) {
+        if (strcmp(topics[i].name, request->topic) == 0) {
+            topic_index = i;
+            break;
+        }
+    }
+
+    // Si el tópico no existe, crearlo
+    if (topic_index == -1) {
+        // Inicializar el nuevo tópico (sin suscriptores, sin bloquear y sin mensajes activos)
+        topic_index = create_topic(request->topic);
+        if (topic_index != -1) {
+            printf("Tópico '%s' creado automáticamente.\n", request->topic);
+        } else {
+            send_response(request->client_pipe, "Error: No se pueden crear más tópicos, límite alcanzado.");
+            return;
+        }
+    }
+
+    // Verificar si el tópico está bloqueado
+    if (topics[topic_index].is_locked) {
+        send_response(request->client_pipe, "El tópico está bloqueado. No se puede enviar el mensaje.");
+        return;
+    }
+
+
+    // La clave se valida antes del control de admisión: una publicación rechazada no gasta tokens
+    if (memchr(request->key, '\0', KEY_LEN) == NULL) {
+        send_response(request->client_pipe, "Error: la clave excede el máximo de caracteres.");
+        return;
+    }
+    if (strpbrk(request->key, " \t\n@") != NULL) {
+        send_response(request->client_pipe, "Error: clave no válida.");
+        return;
+    }
+
+    // Control de admisión: se comprueban ambos límites antes de gastar ningún token
+    if (!rate_limit_allows(&topics[topic_index].limit)) {
+        send_response(request->client_pipe, "Error: Límite de envío del tópico superado. Inténtalo más tarde.");
+        return;
+    }
+    if (sender_index != -1 && !rate_limit_allows(&clients[sender_index].limit)) {
+        send_response(request->client_pipe, "Error: Has superado tu límite de envío. Inténtalo más tarde.");
+        return;
+    }
+    rate_limit_consume(&topics[topic_index].limit);
+    if (sender_index != -1) {
+        rate_limit_consume(&clients[sender_index].limit);
+    }
+
+    // En un tópico compactado un mensaje persistente con clave sustituye al último valor de esa clave
+    MessageRecord *previous = NULL;
+    if (request->lifetime > 0 && topics[topic_index].is_compacted && request->key[0] != '\0') {
+        // Si no caben más mensajes, se recupera antes la memoria de los valores ya sustituidos
+        if (message_count >= MAX_MESSAGES) {
+            compact_messages();
+            rebuild_topic_indexes();
+        }
+        int key_id = find_name(request->key);
+        if (key_id != -1) {
+            previous = *latest_slot(&topics[topic_index], key_id);
+        }
+    }
+
+    // Si el mensaje es persistente, verificar el número de mensajes persistentes en el tópico
+    if (request->lifetime > 0 && previous == NULL) {
+        if (!has_retained_room(&topics[topic_index], request->key[0] != '\0')) {
+            char res[128];
+            if (topics[topic_index].is_compacted && request->key[0] != '\0') {
+                snprintf(res, sizeof(res), "Error: Se ha alcanzado el límite de %d claves en este tópico compactado.", COMPACTED_KEYS_LIMIT);
+            } else {
+                snprintf(res, sizeof(res), "Error: Se ha alcanzado el límite de %d mensajes persistentes en este tópico.", TOPIC_RETAINED_LIMIT);
+            }
+            send_response(request->client_pipe, res);
+            return;
+        }
+    }
+
+    // Almacenar el mensaje: solo se guardan los persistentes, el resto solo se reparte
+    if (request->lifetime > 0) {
+        MessageRecord *record = store_message(request->topic, request->username, request->key, request->lifetime, request->message, time(NULL));
+        if (record == NULL) {
+            send_response(request->client_pipe, "Error: máximo de mensajes alcanzado.");
+            return;
+        }
+        Topic *target = &topics[topic_index];
+        if (previous != NULL) {
+            // Quitar el valor anterior del índice: el nuevo pasa al final, como el más reciente
+            int j = 0;
+            while (target->message_index[j] != previous) {
+                j++;
+            }
+            memmove(target->message_index + j, target->message_index + j + 1,
+                    (target->message_index_count - j - 1) * sizeof(MessageRecord *));
+            target->message_index_count--;
+            supersede_message(previous);
+        }
+        target->message_index[target->message_index_count++] = record;
+        if (target->is_compacted && record->key_id != NO_KEY) {
+            *latest_slot(target, record->key_id) = record;
+        }
+
+        // Marcar que el tópico ahora tiene mensajes activos
+        topics[topic_index].has_active_messages = 1;
+    }
+
+    // Enviar el mensaje a los suscriptores excepto al remitente
+    char formatted_message[1028]; // espacio para el formato
+    if (request->key[0] != '\0') {
+        snprintf(formatted_message, sizeof(formatted_message), "%s %s key=%s %s",
+                 request->topic, request->username, request->key, request->message);
+    } else {
+        snprintf(formatted_message, sizeof(formatted_message), "%s %s %s",
+         request->topic, request->username, request->message);
+    }
+
+    struct timespec fanout_start, fanout_end;
+    clock_gettime(CLOCK_MONOTONIC, &fanout_start);
+
+    // Evaluar cada filtro distinto del tópico una sola vez, sea cual sea el número de suscriptores que lo usan
+    Topic *topic = &topics[topic_index];
+    int filter_passed[MAX_FILTERS];
+    size_t message_length = strlen(request->message);
+    for (int f = 0; f < MAX_FILTERS; f++) {
+        if (topic->filters[f].refs > 0) {
+            filter_passed[f] = filter_matches(&topic->filters[f], request->username, request->message, message_length);
+            delivery_stats.filter_evaluations++;
+        }
+    }
+
+    // Reunir los suscriptores conectados excepto el remitente
+    static int targets[MAX_SUBSCRIBERS]; // solo se usa con el mutex cogido
+    int target_count = 0;
+    for (int i = 0; i < topics[topic_index].subscriber_count; i++) {
+        const char *subscriber_username = topics[topic_index].subscribers[i];
+        int filter = topic->subscriber_filters[i];
+        if (filter != -1 && !filter_passed[filter]) {
+            delivery_stats.filtered_out++;
+            continue; // el mensaje no cumple su filtro: ni se encola ni se escribe
+        }
+        if (strcmp(subscriber_username, request->username) != 0) { // evitar al remitente
+            int k = find_client(subscriber_username);
+            if (k != -1) {
+                targets[target_count++] = k;
+            }
+        }
+    }
+
+    // Los tópicos muy anchos se reparten entre los hilos de reparto
+    if (fanout_threads > 0 && target_count >= fanout_min_width) {
+        fanout_run(FANOUT_SEND, targets, target_count, formatted_message, topic->lane, 0);
+        delivery_stats.parallel_publishes++;
+    } else {
+        for (int t = 0; t < target_count; t++) {
+            send_to_client(targets[t], formatted_message, topic->lane);
+        }
+    }
+
+    // Entregar el mensaje a un único miembro de cada grupo de consumidores
+    for (int g = 0; g < topics[topic_index].group_count; g++) {
+        int k = pick_group_member(&topics[topic_index].groups[g], request->username);
+        if (k != -1) {
+            send_to_client(k, formatted_message, topic->lane);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &fanout_end);
+    unsigned long long fanout_ns = (fanout_end.tv_sec - fanout_start.tv_sec) * 1000000000ULL + (fanout_end.tv_nsec - fanout_start.tv_nsec);
+    delivery_stats.publishes++;
+    delivery_stats.publish_ns += fanout_ns;
+    if (fanout_ns > delivery_stats.publish_max_ns) {
+        delivery_stats.publish_max_ns = fanout_ns;
+    }
+
+    // Guardar el mensaje en el archivo si es persistente: lo escribe el hilo de persistencia
+    // y, en los tópicos duraderos, es ese hilo quien confirma el envío tras llegar al disco
+    int ack_after_persist = request->lifetime > 0 && topics[topic_index].is_durable;
+    if (request->lifetime > 0) {
+        char *line = malloc(PERSIST_LINE_MAX);
+        if (line != NULL) {
+            int len = format_persist_line(line, request->topic, request->username, request->lifetime, request->key, request->message);
+            persist_enqueue(PERSIST_APPEND, line, len, ack_after_persist ? request->client_pipe : NULL);
+        } else {
+            perror("Error al reservar memoria para el mensaje persistente");
+            ack_after_persist = 0;
+        }
+    }
+
+    // Imprimir el mensaje en la consola
+    printf("Mensaje de %s enviado al tópico %s\n", request->username, request->topic);
+
+    // Enviar una respuesta al cliente que envió el mensaje
+    if (!ack_after_persist) {
+        send_response(request->client_pipe, "Mensaje enviado con éxito.");
+    }
+}
+
+
+
+// Función para preparar el registro de un mensaje persistente
+void retained_record(Response *msg, const MessageRecord *record) {
+    memset(msg, 0, sizeof(*msg));
+    msg->command_type = -1;
+    msg->lifetime = record->lifetime;
+    strncpy(msg->topic, name_of(record->topic_id), sizeof(msg->topic) - 1);
+    strncpy(msg->username, name_of(record->sender_id), sizeof(msg->username) - 1);
+    strncpy(msg->message, record->text, sizeof(msg->message) - 1);
+    if (record->key_id != NO_KEY) {
+        strncpy(msg->key, name_of(record->key_id), sizeof(msg->key) - 1);
+    }
+}
+
+// Función para grabar los mensajes persistentes actuales, así quien reproduce parte del mismo estado
+void trace_retained_messages() {
+    Response msg;
+    for (int i = 0; i < message_count; i++) {
+        if (messages[i]->lifetime > 0) {
+            retained_record(&msg, messages[i]);
+            trace_record(TRACE_RETAINED, &msg);
+        }
+    }
+}
+
+// Función para preparar el registro de un comando de un cliente conectado (con su identificador de sesión)
+void session_record(Response *msg, int client, int command_type, const char *topic, const char *text) {
+    memset(msg, 0, sizeof(*msg));
+    msg->command_type = command_type;
+    msg->pid = clients[client].pid;
+    msg->session = SESSION_TOKEN(clients[client].session, sessions[clients[client].session].generation);
+    strncpy(msg->client_pipe, clients[client].client_pipe, sizeof(msg->client_pipe) - 1);
+    strncpy(msg->username, clients[client].username, sizeof(msg->username) - 1);
+    strncpy(msg->topic, topic, sizeof(msg->topic) - 1);
+    strncpy(msg->message, text, sizeof(msg->message) - 1);
+}
+
+// Función para escribir el estado completo como registros que el manager en espera sabe aplicar:
+// sesiones, límites, vigilancia del directorio, suscripciones, mensajes retenidos y ajustes de los tópicos
+void repl_write_state(FILE *file) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t timestamp = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    static const char *filter_kinds[] = { "sender", "contains", "prefix" };
+    Response msg;
+
+    // El límite por defecto va primero: cada sesión restaurada lo toma al conectarse
+    memset(&msg, 0, sizeof(msg));
+    msg.command_type = -1;
+    snprintf(msg.message, sizeof(msg.message), "userlimit * %g %g", default_client_limit.rate, default_client_limit.burst);
+    write_record(file, timestamp, TRACE_ADMIN, &msg);
+
+    for (int i = 0; i < client_count; i++) {
+        session_record(&msg, i, 0, "", clients[i].accepts_compressed ? LZ_CAPABILITY : "");
+        write_record(file, timestamp, TRACE_SESSION, &msg);
+        if (clients[i].limit.rate != default_client_limit.rate || clients[i].limit.burst != default_client_limit.burst) {
+            memset(&msg, 0, sizeof(msg));
+            msg.command_type = -1;
+            snprintf(msg.message, sizeof(msg.message), "userlimit %s %g %g", clients[i].username, clients[i].limit.rate, clients[i].limit.burst);
+            write_record(file, timestamp, TRACE_ADMIN, &msg);
+        }
+        if (clients[i].watches_directory) {
+            session_record(&msg, i, 8, "", "");
+            write_record(file, timestamp, TRACE_CLIENT, &msg);
+        }
+    }
+
+    for (int t = 0; t < topic_count; t++) {
+        Topic *topic = &topics[t];
+        for (int s = 0; s < topic->subscriber_count; s++) {
+            int k = find_client(topic->subscribers[s]);
+            if (k == -1) {
+                continue;
+            }
+            char filter[TAM_MSG] = "";
+            int f = topic->subscriber_filters[s];
+            if (f != -1) {
+                snprintf(filter, sizeof(filter), "%s %s", filter_kinds[topic->filters[f].kind], topic->filters[f].text);
+            }
+            session_record(&msg, k, 1, topic->name, filter);
+            write_record(file, timestamp, TRACE_CLIENT, &msg);
+        }
+        for (int g = 0; g < topic->group_count; g++) {
+            ConsumerGroup *group = &topic->groups[g];
+            char spec[TAM_MSG];
+            snprintf(spec, sizeof(spec), "%s %s", group->name, group->policy == GROUP_LEAST_QUEUE ? "lqd" : "rr");
+            for (int m = 0; m < group->member_count; m++) {
+                int k = find_client(group->members[m]);
+                if (k != -1) {
+                    session_record(&msg, k, 7, topic->name, spec);
+                    write_record(file, timestamp, TRACE_CLIENT, &msg);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < message_count; i++) {
+        if (messages[i]->lifetime > 0) {
+            retained_record(&msg, messages[i]);
+            write_record(file, timestamp, TRACE_RETAINED, &msg);
+        }
+    }
+
+    // Los ajustes se aplican al final, cuando ya existen todos los tópicos
+    for (int t = 0; t < topic_count; t++) {
+        Topic *topic = &topics[t];
+        const char *settings[6] = { NULL };
+        char limit[TAM_MSG];
+        if (topic->is_locked) {
+            settings[0] = "lock %s";
+        }
+        if (topic->limit.rate > 0) {
+            snprintf(limit, sizeof(limit), "limit %%s %g %g", topic->limit.rate, topic->limit.burst);
+            settings[1] = limit;
+        }
+        if (topic->is_durable) {
+            settings[2] = "durable %s on";
+        }
+        if (topic->lane != LANE_NORMAL) {
+            settings[3] = topic->lane == LANE_HIGH ? "priority %s high" : "priority %s low";
+        }
+        if (topic->is_compacted) {
+            settings[4] = "compact %s on";
+        }
+        if (topic->is_compressed) {
+            settings[5] = "compress %s on";
+        }
+        for (int i = 0; i < 6; i++) {
+            if (settings[i] != NULL) {
+                memset(&msg, 0, sizeof(msg));
+                msg.command_type = -1;
+                snprintf(msg.message, sizeof(msg.message), settings[i], topic->name);
+                write_record(file, timestamp, TRACE_ADMIN, &msg);
+            }
+        }
+    }
+
+    // Reconstruir el estado también cambia el directorio: se deja en la secuencia que ven los clientes
+    memset(&msg, 0, sizeof(msg));
+    msg.command_type = -1;
+    snprintf(msg.message, sizeof(msg.message), "%llu", directory_seq);
+    write_record(file, timestamp, TRACE_DIRECTORY, &msg);
+}
+
+// Función para reiniciar el registro de replicación con cada snapshot: el estado completo se escribe en
+// un archivo nuevo que sustituye al anterior, así el registro no crece sin límite. Si desde el último
+// reinicio solo hay latidos se espera a que ocupen REPL_IDLE_BYTES, porque el estado no ha cambiado.
+// El cerrojo del registro anterior se libera después de sustituirlo, de modo que el manager en espera ve
+// primero el archivo nuevo y no confunde el reinicio con la caída del principal (con el mutex y admin_mutex cogidos)
+void repl_rotate() {
+    if (repl_file == NULL || (repl_changes == 0 && ftell(repl_file) < REPL_IDLE_BYTES)) {
+        return;
+    }
+    char path[sizeof(repl_log_path) + 8];
+    snprintf(path, sizeof(path), "%s.tmp", repl_log_path);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("Error al reiniciar el registro de replicación");
+        return;
+    }
+    if (flock(fileno(file), LOCK_EX | LOCK_NB) == -1) {
+        perror("Error al bloquear el nuevo registro de replicación");
+        fclose(file);
+        unlink(path);
+        return;
+    }
+    uint32_t version = TRACE_VERSION;
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), file);
+    fwrite(&version, sizeof(version), 1, file);
+    repl_write_state(file);
+
+    pthread_mutex_lock(&trace_mutex);
+    if (fflush(file) != 0 || rename(path, repl_log_path) == -1) {
+        perror("Error al sustituir el registro de replicación");
+        pthread_mutex_unlock(&trace_mutex);
+        fclose(file);
+        unlink(path);
+        return;
+    }
+    fclose(repl_file);
+    repl_file = file;
+    repl_changes = 0;
+    replication_stats.rotations++;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+// Función para restaurar la sesión de un cliente del registro de replicación con su mismo identificador,
+// así los clientes siguen usando el suyo tras el relevo
+void restore_client(const Response *msg) {
+    uint32_t token = add_client(msg->client_pipe, msg->username, msg->pid, msg->session);
+    if (token != 0) {
+        clients[resolve_session(token)].accepts_compressed = strcmp(msg->message, LZ_CAPABILITY) == 0;
+    }
+}
+
+// Función para vaciar el estado: sin clientes, sin tópicos y sin mensajes retenidos (con el mutex cogido)
+void reset_state() {
+    while (client_count > 0) {
+        drop_client(client_count - 1);
+    }
+    for (int i = 0; i < message_count; i++) {
+        messages[i]->lifetime = 0;
+    }
+    compact_messages();
+    topic_count = 0;
+    init_sessions();
+}
+
+// Función para cargar una línea del archivo de mensajes, devuelve 1 si se cargó el mensaje,
+// 0 si se descartó y -1 si se alcanzó el límite de mensajes
+int load_line(const char *line) {
+    char topic[TOPIC_NAME_LEN], username[USERNAME_LEN], text[TAM_MSG];
+    char lifetime_field[KEY_LEN + 16]; // "lifetime" o "lifetime@clave"
+    if (sscanf(line, "%20s %256s %47s %300[^\n]", topic, username, lifetime_field, text) != 4) {
+        return 0;
+    }
+    int lifetime = atoi(lifetime_field);
+    char *key = strchr(lifetime_field, '@');
+    key = key != NULL ? key + 1 : "";
+    // Solo cargar los mensajes cuyo lifetime sea mayor a 0
+    if (lifetime <= 0) {
+        return 0;
+    }
+    // Si el tópico no existe, agregarlo
+    if (find_topic(topic) == -1 && create_topic(topic) == -1) {
+        return 0;
+    }
+    // Se desconoce el momento original del mensaje
+    return store_message(topic, username, key, lifetime, text, time(NULL)) != NULL ? 1 : -1;
+}
+
+// Función para cargar la línea que marca un tópico como compactado por clave: sus mensajes se compactan
+// al terminar la carga
+void load_compaction(const char *line) {
+    char topic[TOPIC_NAME_LEN];
+    if (sscanf(line, COMPACT_DISK_TAG "%20s", topic) != 1) {
+        return;
+    }
+    int i = find_topic(topic);
+    if (i == -1 && (i = create_topic(topic)) == -1) {
+        return;
+    }
+    topics[i].is_compacted = 1;
+}
+
+// Función para cargar la marca de un tópico comprimido escrito sin comprimir: su diccionario se entrena
+// de nuevo con los mensajes cargados
+void load_compression(const char *line) {
+    char topic[TOPIC_NAME_LEN];
+    if (sscanf(line, COMPRESS_DISK_TAG "%20s", topic) != 1) {
+        return;
+    }
+    int i = find_topic(topic);
+    if (i == -1 && (i = create_topic(topic)) == -1) {
+        return;
+    }
+    topics[i].is_compressed = 1;
+}
+
+// Función para cargar una línea con el diccionario de un tópico comprimido: el tópico queda comprimido
+// con el mismo diccionario, así los clientes que ya lo tienen no lo vuelven a recibir
+void load_dictionary(char *line, size_t length) {
+    char topic[TOPIC_NAME_LEN];
+    unsigned id;
+    int consumed = 0;
+    if (sscanf(line, LZ_DISK_DICT_TAG "%20s %u%n", topic, &id, &consumed) != 2 || (size_t)consumed >= length) {
+        return;
+    }
+    int i = find_topic(topic);
+    if (i == -1 && (i = create_topic(topic)) == -1) {
+        return;
+    }
+    long dictionary_len = cobs_decode(line + consumed + 1, length - consumed - 1, topics[i].dictionary, LZ_DICT_SIZE, '\n');
+    if (dictionary_len <= 0 || lz_dictionary_id(topics[i].dictionary, dictionary_len) != id) {
+        printf("Diccionario del tópico '%s' dañado en el archivo de mensajes.\n", topic);
+        topics[i].dictionary_len = 0; // se entrena uno nuevo
+        return;
+    }
+    topics[i].is_compressed = 1;
+    topics[i].dictionary_len = dictionary_len;
+    topics[i].dictionary_id = id;
+}
+
+// Función para cargar un bloque comprimido de mensajes, devuelve los mensajes cargados o -1 si se
+// alcanzó el límite de mensajes
+int load_block(char *line, size_t length) {
+    char topic[TOPIC_NAME_LEN];
+    unsigned id;
+    int raw_len, consumed = 0;
+    if (sscanf(line, LZ_DISK_TAG "%20s %u %d%n", topic, &id, &raw_len, &consumed) != 3 || (size_t)consumed >= length ||
+        raw_len <= 0 || raw_len >= MAX_MESSAGES * PERSIST_LINE_MAX) {
+        return 0;
+    }
+    int i = find_topic(topic);
+    if (i == -1 || topics[i].dictionary_id != id) {
+        printf("Bloque del tópico '%s' sin su diccionario en el archivo de mensajes: se descarta.\n", topic);
+        return 0;
+    }
+
+    char compressed[MAX_MESSAGES * PERSIST_LINE_MAX];
+    char raw[MAX_MESSAGES * PERSIST_LINE_MAX];
+    long size = cobs_decode(line + consumed + 1, length - consumed - 1, compressed, sizeof(compressed), '\n');
+    if (size <= 0 || lz_decompress(topics[i].dictionary, topics[i].dictionary_len, compressed, size, raw, raw_len) != raw_len) {
+        printf("Bloque del tópico '%s' dañado en el archivo de mensajes: se descarta.\n", topic);
+        return 0;
+    }
+    raw[raw_len] = '\0';
+
+    // El bloque contiene las mismas líneas que se escribirían sin comprimir
+    int loaded = 0;
+    for (char *next, *text = raw; *text != '\0'; text = next) {
+        next = strchr(text, '\n');
+        next = next != NULL ? next + 1 : text + strlen(text);
+        int result = load_line(text);
+        if (result == -1) {
+            return -1;
+        }
+        loaded += result;
+    }
+    return loaded;
+}
+
+// Función para cargar los mensajes cuyo lifetime sea mayor a 0 desde el archivo
+int load_messages() {
+    const char* msg_file = getenv("MSG_FICH"); // obtener el archivo desde la variable de entorno
+    if (!msg_file) {
+        perror("Variable de entorno MSG_FICH no configurada");
+        return 0;
+    }
+
+    FILE* file = fopen(msg_file, "r"); // abrir el archivo para lectura
+    if (!file) {
+        perror("Error al abrir el archivo de mensajes para lectura");
+        return 0;
+    }
+
+    int loaded_count = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    // Las líneas de los bloques comprimidos pueden contener nulos: se usa la longitud leída
+    while ((length = getline(&line, &size, file)) != -1) {
+        if (line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        int result;
+        if (strncmp(line, COMPACT_DISK_TAG, strlen(COMPACT_DISK_TAG)) == 0) {
+            load_compaction(line);
+            continue;
+        } else if (strncmp(line, COMPRESS_DISK_TAG, strlen(COMPRESS_DISK_TAG)) == 0) {
+            load_compression(line);
+            continue;
+        } else if (strncmp(line, LZ_DISK_DICT_TAG, strlen(LZ_DISK_DICT_TAG)) == 0) {
+            load_dictionary(line, length);
+            continue;
+        } else if (strncmp(line, LZ_DISK_TAG, strlen(LZ_DISK_TAG)) == 0) {
+            result = load_block(line, length);
+        } else {
+            result = load_line(line);
+        }
+        if (result == -1) {
+            break; // límite de mensajes alcanzado
+        }
+        loaded_count += result; // incrementar el contador si el mensaje es válido
+    }
+
+    free(line);
+    fclose(file); // cerrar el archivo después de leer
+    rebuild_topic_indexes(); // marca también los tópicos con mensajes activos
+    return loaded_count; // retornar el número de mensajes cargados
+}
+
+
+// Función para comprobar si el proceso de un cliente sigue vivo
+int client_is_alive(const Client *client) {
+    if (client->is_dead) {
+        return 0;
+    }
+    if (replay_mode) {
+        return 1; // los clientes de una traza no son procesos reales
+    }
+    return client->pid <= 0 || kill(client->pid, 0) == 0 || errno != ESRCH;
+}
+
+// Función para eliminar las sesiones de clientes que murieron sin avisar (SIGKILL, fallo...)
+void reap_dead_clients() {
+    for (int i = 0; i < client_count; i++) {
+        if (client_is_alive(&clients[i])) {
+            continue;
+        }
+        char username[USERNAME_LEN];
+        char client_pipe[256];
+        memcpy(username, clients[i].username, USERNAME_LEN);
+        memcpy(client_pipe, clients[i].client_pipe, sizeof(client_pipe));
+        printf("El cliente '%s' (PID: %d) ya no está activo. Eliminando su sesión.\n", username, clients[i].pid);
+        trace_reap(username);
+
+        drop_client(i);
+        drop_subscriptions(username);
+        unlink(client_pipe); // el cliente no pudo borrar su pipe
+        i--; // ajustar el índice
+    }
+}
+
+// Función para borrar las pipes de clientes que ya no existen (restos de una ejecución anterior)
+void remove_stale_pipes() {
+    DIR *dir = opendir(".");
+    if (dir == NULL) {
+        perror("Error al abrir el directorio de trabajo");
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int pid;
+        if (sscanf(entry->d_name, "client_pipe_%d", &pid) == 1 && kill(pid, 0) == -1 && errno == ESRCH) {
+            unlink(entry->d_name);
+            printf("Eliminada la pipe huérfana '%s'.\n", entry->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+// Función que maneja la señal SIGUSR1 (eliminación de hilos)
+void thread_signal_handler(int sig) {
+    if (sig == SIGUSR1) {
+        terminate_thread = 1;
+    }
+}
+
+// Función para hacer una pasada del lifetime: reintentos de entrega, sesiones muertas, caducidad de los
+// mensajes y reescritura del archivo (con el mutex cogido)
+void lifetime_tick() {
+    // Reintentar, como respaldo, las entregas a los clientes que tenían la pipe llena
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].is_blocked) {
+            clients[i].is_blocked = 0;
+            flush_client(i, FLUSH_RETRY);
+        }
+    }
+
+    // Eliminar las sesiones de los clientes muertos
+    reap_dead_clients();
+
+    // Decrementar el lifetime de los mensajes
+    int expired = 0;
+    for (int i = 0; i < message_count; i++) {
+        if (messages[i]->lifetime > 0) {
+            messages[i]->lifetime--;  // decrementar el lifetime
+        }
+        if (messages[i]->lifetime == 0) {
+            expired++;
+        }
+    }
+
+    // Eliminar mensajes con lifetime == 0: se recupera su memoria en bloque
+    if (expired > 0) {
+        compact_messages();
+    }
+
+    // Reconstruir los índices por tópico y comprobar si algún tópico tiene mensajes activos
+    rebuild_topic_indexes();
+
+    // Eliminar tópicos sin mensajes activos y sin suscriptores
+    for (int i = 0; i < topic_count; i++) {
+        if (!topics[i].has_active_messages && topics[i].subscriber_count == 0 && topics[i].group_count == 0) {
+            directory_event("eliminado", &topics[i]);
+            for (int j = i; j < topic_count - 1; j++) {
+                topics[j] = topics[j + 1];  // desplazar los tópicos
+            }
+            topic_count--;  // reducir el contador de tópicos
+            i--;  // ajustar el índice
+        }
+    }
+
+    // Entrenar el diccionario de los tópicos comprimidos en cuanto tienen mensajes retenidos
+    for (int i = 0; i < topic_count; i++) {
+        if (topics[i].is_compressed && topics[i].dictionary_len == 0 && topics[i].message_index_count > 0) {
+            train_dictionary(&topics[i]);
+        }
+    }
+
+    // Reescribir el archivo solo con los mensajes con lifetime > 0: se prepara el contenido
+    // con el mutex cogido y el hilo de persistencia lo escribe en orden con los envíos.
+    // Un tópico comprimido nunca ocupa más que sus líneas; cada tópico suma su marca de comprimido y la de compactado
+    size_t capacity = (size_t)message_count * PERSIST_LINE_MAX + (size_t)topic_count * 2 * (TOPIC_NAME_LEN + 16) + 1;
+    char *snapshot = malloc(capacity);
+    if (snapshot != NULL) {
+        size_t len = 0;
+        char written[MAX_NAMES] = { 0 }; // Tópicos comprimidos (por su nombre compartido) ya escritos
+        for (int i = 0; i < topic_count; i++) {
+            if (topics[i].is_compacted) {
+                len += sprintf(snapshot + len, COMPACT_DISK_TAG "%s\n", topics[i].name); // antes que sus mensajes
+            }
+        }
+        for (int i = 0; i < topic_count; i++) {
+            if (topics[i].is_compressed && topics[i].message_index_count > 0) {
+                len += format_compressed_topic(&topics[i], snapshot + len);
+                written[topics[i].message_index[0]->topic_id] = 1;
+            }
+        }
+        for (int i = 0; i < message_count; i++) {
+            if (messages[i]->lifetime > 0 && !written[messages[i]->topic_id]) {
+                len += format_persist_line(snapshot + len, name_of(messages[i]->topic_id),
+                                           name_of(messages[i]->sender_id), messages[i]->lifetime,
+                                           messages[i]->key_id != NO_KEY ? name_of(messages[i]->key_id) : "",
+                                           messages[i]->text);
+            }
+        }
+        persist_enqueue(PERSIST_SNAPSHOT, snapshot, len, NULL);
+    } else {
+        perror("Error al reservar memoria para reescribir el archivo de mensajes");
+    }
+}
+
+// Función para disminuir el lifetime de los mensajes cada segundo y almacenar solamente los mensajes persistentes en el archivo
+void* manage_lifetime(void* arg) {
+    struct sigaction sa;
+    sa.sa_handler = thread_signal_handler;  // registrar el manejador de señales
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGUSR1, &sa, NULL);  // asignar el manejador para SIGUSR1
+
+    while (!terminate_thread) {
+        sleep(1);  // esperar 1 segundo para actualizar el archivo
+
+        // El registro de replicación vuelve a empezar con el estado de cada snapshot; admin_mutex evita
+        // que un comando del administrador quede grabado en el registro anterior sin estar en ese estado
+        pthread_mutex_lock(&admin_mutex);
+        pthread_mutex_lock(&mutex);
+        lifetime_tick();
+        repl_rotate();
+        pthread_mutex_unlock(&mutex);
+        pthread_mutex_unlock(&admin_mutex);
+    }
+    pthread_exit(NULL); // finaliza el hilo
+}
+
+// Función para escribir en el archivo todo el bloque acumulado y confirmar los envíos duraderos
+// (con io_uring la escritura y la sincronización de los envíos duraderos se envían juntas en una llamada)
+void persist_flush(int fd, Uring *ring, char *batch, size_t *batch_len, PersistRecord **acks, int *ack_count) {
+    size_t done = 0;
+    int synced = 0;
+    if (ring->fd != -1 && *batch_len > 0) {
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)batch;
+        sqe->len = *batch_len;
+        sqe->off = (uint64_t)-1; // al final del archivo (O_APPEND)
+        unsigned count = 1;
+        if (*ack_count > 0) {
+            sqe->flags |= IOSQE_IO_LINK; // la sincronización solo empieza si la escritura se completa
+            sqe = uring_sqe(ring);
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = fd;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->user_data = 1;
+            count = 2;
+        }
+        uring_submit(ring, count);
+        for (unsigned seen = 0; seen < count; ) {
+            struct io_uring_cqe *cqe = uring_peek(ring);
+            if (cqe == NULL) {
+                uring_submit(ring, count - seen);
+                continue;
+            }
+            if (cqe->user_data == 0 && cqe->res > 0) {
+                done = cqe->res; // una escritura incompleta se termina con write
+            } else if (cqe->user_data == 1 && cqe->res == 0) {
+                synced = 1;
+            }
+            uring_seen(ring);
+            seen++;
+        }
+    }
+    while (done < *batch_len) {
+        ssize_t written = write(fd, batch + done, *batch_len - done);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error al escribir en el archivo de mensajes");
+            break;
+        }
+        done += written;
+    }
+    *batch_len = 0;
+
+    if (*ack_count == 0) {
+        return;
+    }
+
+    // Los envíos duraderos se confirman cuando el bloque ha llegado al disco
+    if (!synced) {
+        fdatasync(fd);
+    }
+    pthread_mutex_lock(&mutex);
+    for (int i = 0; i < *ack_count; i++) {
+        send_response(acks[i]->ack_pipe, "Mensaje enviado con éxito.");
+        free(acks[i]->data);
+        free(acks[i]);
+    }
+    flush_all_clients(FLUSH_IDLE);
+    pthread_mutex_unlock(&mutex);
+    *ack_count = 0;
+}
+
+// Función para reemplazar el archivo de mensajes de forma atómica, devuelve el nuevo descriptor para añadir
+int persist_snapshot(const char *msg_file, int fd, PersistRecord *record) {
+    char tmp_file[512];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", msg_file);
+
+    // Escribir en un archivo temporal y renombrarlo: los lectores nunca ven un archivo a medias
+    int tmp_fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tmp_fd == -1) {
+        perror("Error al abrir el archivo de mensajes para reescritura");
+        return fd;
+    }
+    size_t done = 0;
+    while (done < record->len) {
+        ssize_t written = write(tmp_fd, record->data + done, record->len - done);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written == -1) {
+            perror("Error al reescribir el archivo de mensajes");
+            close(tmp_fd);
+            unlink(tmp_file);
+            return fd;
+        }
+        done += written;
+    }
+    close(tmp_fd);
+
+    if (rename(tmp_file, msg_file) == -1) {
+        perror("Error al reemplazar el archivo de mensajes");
+        unlink(tmp_file);
+        return fd;
+    }
+
+    // El descriptor anterior apunta al archivo reemplazado
+    close(fd);
+    fd = open(msg_file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("Error al abrir el archivo de mensajes");
+    }
+    return fd;
+}
+
+// Función del hilo de persistencia: agrupa los registros en escrituras secuenciales grandes
+void* persist_writer(void* arg) {
+    const char *msg_file = getenv("MSG_FICH");
+    if (!msg_file) {
+        perror("Variable de entorno MSG_FICH no configurada");
+        return NULL;
+    }
+    int fd = open(msg_file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("Error al abrir el archivo de mensajes");
+    }
+
+    char *batch = malloc(PERSIST_BATCH_SIZE);
+    size_t batch_len = 0;
+    Uring ring = { .fd = -1 }; // anillo propio del hilo de persistencia
+    if (io_backend == IO_URING && uring_setup(&ring, 4) == -1) {
+        perror("Error al crear el anillo de io_uring de la persistencia");
+    }
+    PersistRecord *acks[PERSIST_BATCH_SIZE / 64];
+    int ack_count = 0;
+
+    while (1) {
+        sem_wait(&persist_sem);
+        while (sem_trywait(&persist_sem) == 0) {
+            // un solo despertar basta para vaciar la cola
+        }
+
+        PersistRecord *record;
+        while ((record = persist_queue_pop(&persist_queue)) != NULL) {
+            if (record->kind == PERSIST_SNAPSHOT) {
+                persist_flush(fd, &ring, batch, &batch_len, acks, &ack_count);
+                fd = persist_snapshot(msg_file, fd, record);
+                free(record->data);
+                free(record);
+                continue;
+            }
+
+            // Vaciar el bloque si el registro no cabe o no quedan huecos para confirmaciones
+            if (batch_len + record->len > PERSIST_BATCH_SIZE || ack_count == (int)(sizeof(acks) / sizeof(acks[0]))) {
+                persist_flush(fd, &ring, batch, &batch_len, acks, &ack_count);
+            }
+            memcpy(batch + batch_len, record->data, record->len);
+            batch_len += record->len;
+
+            if (record->ack_pipe[0] != '\0') {
+                acks[ack_count++] = record; // se libera tras confirmar
+            } else {
+                free(record->data);
+                free(record);
+            }
+        }
+        persist_flush(fd, &ring, batch, &batch_len, acks, &ack_count);
+
+        if (persist_shutdown && persist_queue_empty(&persist_queue)) {
+            break;
+        }
+    }
+
+    free(batch);
+    uring_close(&ring);
+    if (fd != -1) {
+        close(fd);
+    }
+    pthread_exit(NULL); // finaliza el hilo
+}
+
+// Función para eliminar un cliente de la sesión actual a partir de su índice en clients[]
+void remove_client_at(int i) {
+    char username[USERNAME_LEN];
+    strcpy(username, clients[i].username); // drop_client desplaza la lista
+    // Enviar la señal SIGTERM al proceso del cliente para finalizar su proceso
+    if (clients[i].pid > 0) {
+        signal_client(clients[i].pid, SIGTERM);
+        printf("Se envió SIGTERM a %s (PID: %d)\n", username, clients[i].pid);
+    }
+    // Desplazar elementos hacia atrás para eliminar al cliente
+    drop_client(i);
+    leave_all_groups(username); // reequilibrar los grupos de consumidores
+    printf("Cliente '%s' ha sido eliminado de la lista de conectados.\n", username);
+    char formatted_message[USERNAME_LEN + 64];
+    snprintf(formatted_message, sizeof(formatted_message), "El  cliente '%s' ha sido eliminado de la lista de conectados.\n", username);  
+    // Notificar a los clientes conectados (en el modo repartido todos los shards conocen a todos
+    // los usuarios: solo avisa el primero)
+    for (int i = 0; i < client_count && shard_index == 0; i++) {
+        send_response(clients[i].client_pipe, formatted_message);
+    }
+}
+
+// Función para eliminar un cliente de la sesión actual
+void remove_client(const char *username) {
+    int i = find_client(username);
+    if (i == -1) {
+        printf("Cliente '%s' no encontrado.\n", username);
+        return;
+    }
+    remove_client_at(i);
+}
+
+// Función para mostrar una página de los mensajes persistentes de un topico desde su índice en memoria
+// (sender y max_age son filtros opcionales: NULL y 0 para no filtrar)
+void show_messages(const char *topic_name, int offset, int limit, const char *sender, int max_age) {
+    int i = find_topic(topic_name);
+    if (i == -1) {
+        printf("El tópico '%s' no existe.\n", topic_name);
+        return;
+    }
+    Topic *topic = &topics[i];
+    time_t now = time(NULL);
+
+    // Sin filtros se salta directamente a la página pedida
+    int filtered = sender != NULL || max_age > 0;
+    int j = filtered ? 0 : offset;
+    int skipped = filtered ? 0 : offset;
+    int shown = 0;
+
+    for (; j < topic->message_index_count && shown < limit; j++) {
+        MessageRecord *msg = topic->message_index[j];
+        if (sender != NULL && strcmp(name_of(msg->sender_id), sender) != 0) {
+            continue;
+        }
+        if (max_age > 0 && now - (time_t)msg->created > max_age) {
+            continue;
+        }
+        if (skipped < offset) {
+            skipped++;
+            continue;
+        }
+        if (msg->key_id != NO_KEY) {
+            printf("Usuario: %s, Clave: %s, Mensaje: %s\n", name_of(msg->sender_id), name_of(msg->key_id), msg->text);
+        } else {
+            printf("Usuario: %s, Mensaje: %s\n", name_of(msg->sender_id), msg->text);  // imprimir información del mensaje
+        }
+        shown++;
+    }
+
+    if (shown == 0) {
+        printf("No hay mensajes en el tópico '%s'.\n", topic_name);
+    } else {
+        printf("Mostrados %d mensajes desde la posición %d (%d en el tópico).\n", shown, offset, topic->message_index_count);
+    }
+}
+
+
+// Función para manejar el CTRL+C del cliente (i es su índice en clients[], -1 si no está conectado)
+void handle_ctrlc(const char *username, int i) {
+    if (i == -1) {
+        printf("Cliente '%s' no encontrado.\n", username);
+        return;
+    }
+    // Enviar la señal SIGTERM al proceso del cliente para finalizar su proceso
+    if (clients[i].pid > 0) {
+        signal_client(clients[i].pid, SIGINT);
+        printf("Se envió SIGINT a %s (PID: %d)\n", username, clients[i].pid);
+    }
+    // Desplazar elementos hacia atrás para eliminar al cliente
+    drop_client(i);
+    leave_all_groups(username); // reequilibrar los grupos de consumidores
+    printf("Cliente '%s' ha sido eliminado de la lista de conectados.\n", username);
+}
+
+// Función para bloquear el envío de mensajes en un topico
+void lock_topic(const char *topic_name) {
+    for (int i = 0; i < topic_count; i++) {
+        if (strcmp(topics[i].name, topic_name) == 0) {
+            if (!topics[i].is_locked) {
+                topics[i].is_locked = 1; // bloquear el tópico
+                directory_event("bloqueado", &topics[i]);
+                printf("Tópico '%s' bloqueado.\n", topic_name);
+
+                // Notificar a los suscriptores del bloqueo
+                char notification[256];
+                snprintf(notification, sizeof(notification), "El tópico '%s' ha sido bloqueado. No se pueden enviar mensajes temporalmente.", topic_name);
+                notify_topic_subscribers(i, notification);
+            } else {
+                printf("El tópico '%s' ya está bloqueado.\n", topic_name);
+            }
+            return;
+        }
+    }
+    printf("No se encontró el tópico '%s' para bloquear.\n", topic_name);
+}
 
-    // Almacenar el mensaje
-    if (message_count < MAX_MESSAGES) {
-        // Guardar el mensaje en la estructura de mensajes
-        strncpy(messages[message_count].topic, request->topic, sizeof(messages[message_count].topic) - 1);
-        strncpy(messages[message_count].username, request->username, sizeof(messages[message_count].username) - 1);
-        strncpy(messages[message_count].message, request->message, sizeof(messages[message_count].message) - 1);
-        messages[message_count].lifetime = request->lifetime; // lifetime restante
-        message_count++;
+// Función para bloquear el envío de mensajes en un topico
+void unlock_topic(const char* topic_name) {
+    for (int i = 0; i < topic_count; i++) {
+        if (strcmp(topics[i].name, topic_name) == 0) {
+            if (topics[i].is_locked) {
+                topics[i].is_locked = 0;  // desbloquear el tópico
+                directory_event("desbloqueado", &topics[i]);
+                printf("El tópico '%s' ha sido desbloqueado para el envío de mensajes.\n", topic_name);
 
-        // Marcar que el tópico ahora tiene mensajes activos
-        topics[topic_index].has_active_messages = 1;
-        // Enviar el mensaje a los suscriptores excepto al remitente
-        char formatted_message[1028]; // espacio para el formato
-        snprintf(formatted_message, sizeof(formatted_message), "%s %s %s",
-         request->topic, request->username, request->message);
+                // Notificar a los suscriptores del desbloqueo
+                char notification[256];
+                snprintf(notification, sizeof(notification), "El tópico '%s' ha sido desbloqueado. Ya puedes enviar mensajes.", topic_name);
+                notify_topic_subscribers(i, notification);
+            } else {
+                printf("El tópico '%s' ya está desbloqueado.\n", topic_name);
+            }
+            return;
+        }
+    }
+    printf("Error: Tópico '%s' no encontrado.\n", topic_name);
+}
 
-        // Enviar el mensaje a los suscriptores excepto al remitente
-        for (int i = 0; i < topics[topic_index].subscriber_count; i++) {
-            const char *subscriber_username = topics[topic_index].subscribers[i];
-            if (strcmp(subscriber_username, request->username) != 0) { // evitar al remitente
-                for (int j = 0; j < client_count; j++) {
-                    if (strcmp(clients[j].username, subscriber_username) == 0) {
-                        send_response(clients[j].client_pipe, formatted_message);
-                    }
-                }
+
+// Función para limitar el ritmo de envío a un tópico
+void limit_topic(const char *topic_name, double rate, double burst) {
+    int i = find_topic(topic_name);
+    if (i == -1) {
+        printf("No se encontró el tópico '%s' para limitar.\n", topic_name);
+        return;
+    }
+    set_rate_limit(&topics[i].limit, rate, burst);
+    if (rate > 0) {
+        printf("Tópico '%s' limitado a %.2f mensajes/s (ráfaga %.0f).\n", topic_name, rate, topics[i].limit.burst);
+    } else {
+        printf("Eliminado el límite de envío del tópico '%s'.\n", topic_name);
+    }
+}
+
+// Función para limitar el ritmo de envío de un usuario ("*" cambia el límite por defecto de los nuevos clientes)
+void limit_user(const char *username, double rate, double burst) {
+    if (strcmp(username, "*") == 0) {
+        set_rate_limit(&default_client_limit, rate, burst);
+        printf("Límite por defecto de los clientes: %.2f mensajes/s (ráfaga %.0f).\n", rate, default_client_limit.burst);
+        return;
+    }
+    int i = find_client(username);
+    if (i == -1) {
+        printf("Cliente '%s' no encontrado.\n", username);
+        return;
+    }
+    set_rate_limit(&clients[i].limit, rate, burst);
+    if (rate > 0) {
+        printf("Usuario '%s' limitado a %.2f mensajes/s (ráfaga %.0f).\n", username, rate, clients[i].limit.burst);
+    } else {
+        printf("Eliminado el límite de envío del usuario '%s'.\n", username);
+    }
+}
+
+// Función para asignar el carril de entrega de los mensajes de un tópico
+void set_topic_priority(const char *topic_name, int lane) {
+    int i = find_topic(topic_name);
+    if (i == -1) {
+        printf("No se encontró el tópico '%s'.\n", topic_name);
+        return;
+    }
+    topics[i].lane = lane;
+    printf("Tópico '%s': prioridad %s.\n", topic_name, lane == LANE_HIGH ? "alta" : lane == LANE_LOW ? "baja" : "normal");
+}
+
+// Función para activar o desactivar la compactación por clave de un tópico
+void set_topic_compaction(const char *topic_name, int compacted) {
+    int i = find_topic(topic_name);
+    if (i == -1) {
+        printf("No se encontró el tópico '%s'.\n", topic_name);
+        return;
+    }
+    topics[i].is_compacted = compacted;
+    if (compacted) {
+        // Los mensajes ya retenidos se compactan ahora; el archivo se reescribe en la siguiente pasada del lifetime
+        unsigned long before = superseded_messages;
+        compact_topic_index(&topics[i]);
+        printf("Tópico '%s' compactado por clave (%lu mensajes sustituidos).\n", topic_name, superseded_messages - before);
+    } else {
+        printf("Tópico '%s': se retienen todos los mensajes.\n", topic_name);
+    }
+}
+
+// Función para activar o desactivar la compresión de los mensajes retenidos de un tópico
+void set_topic_compression(const char *topic_name, int compressed) {
+    int i = find_topic(topic_name);
+    if (i == -1) {
+        printf("No se encontró el tópico '%s'.\n", topic_name);
+        return;
+    }
+    topics[i].is_compressed = compressed;
+    if (compressed && topics[i].dictionary_len == 0) {
+        train_dictionary(&topics[i]); // sin mensajes retenidos se entrena en la siguiente pasada del lifetime
+    }
+    if (compressed) {
+        printf("Tópico '%s' comprimido (diccionario de %d bytes).\n", topic_name, topics[i].dictionary_len);
+    } else {
+        printf("Tópico '%s': mensajes retenidos sin comprimir.\n", topic_name);
+    }
+}
+
+// Función para configurar si los envíos persistentes de un tópico se confirman tras llegar al disco
+void set_topic_durability(const char *topic_name, int durable) {
+    int i = find_topic(topic_name);
+    if (i == -1) {
+        printf("No se encontró el tópico '%s'.\n", topic_name);
+        return;
+    }
+    topics[i].is_durable = durable;
+    printf("Tópico '%s': confirmación %s.\n", topic_name,
+           durable ? "tras escribir en disco" : "inmediata");
+}
+
+// Función para mostrar el uso de memoria de los mensajes retenidos
+void print_memory_usage() {
+    size_t payload = 0;
+    for (int i = 0; i < message_count; i++) {
+        payload += messages[i]->length;
+    }
+    size_t name_bytes = 0;
+    for (int i = 0; i < MAX_NAMES; i++) {
+        if (name_table[i].name != NULL) {
+            name_bytes += strlen(name_table[i].name) + 1;
+        }
+    }
+
+    printf("Mensajes retenidos: %d\n", message_count);
+    printf(" - Carga útil: %zu bytes\n", payload);
+    printf(" - Arena: %zu bytes ocupados, %zu reservados en %zu bloques\n",
+           message_arena.used, message_arena.reserved, message_arena.chunk_count);
+    printf(" - Nombres compartidos: %d (%zu bytes)\n", name_count, name_bytes);
+    int compacted = 0, keys = 0;
+    for (int i = 0; i < topic_count; i++) {
+        if (topics[i].is_compacted) {
+            compacted++;
+            for (int j = 0; j < topics[i].message_index_count; j++) {
+                keys += topics[i].message_index[j]->key_id != NO_KEY;
             }
         }
+    }
+    printf(" - Compactación por clave: %d tópicos, %d claves retenidas, %lu mensajes sustituidos\n",
+           compacted, keys, superseded_messages);
+    if (message_count > 0) {
+        printf(" - Por mensaje: %.1f bytes ocupados para %.1f bytes de carga útil (cabecera de %zu bytes)\n",
+               (double)message_arena.used / message_count, (double)payload / message_count, sizeof(MessageRecord));
+    }
+}
 
-        // Guardar el mensaje en el archivo si es persistente
-        if (request->lifetime > 0) {
-            const char* msg_file = getenv("MSG_FICH");
-            if (msg_file) {
-                FILE* file = fopen(msg_file, "a");
-                if (file) {
-                    fprintf(file, "%s %s %d %s\n",
-                            request->topic, request->username, request->lifetime, request->message);
-                    fclose(file);
-                } else {
-                    perror("Error al abrir el archivo de mensajes");
-                }
+// Función para mostrar las estadísticas de entrega a los clientes
+void print_delivery_stats() {
+    printf("Entregas: %lu mensajes en %lu escrituras (%.3f escrituras por mensaje)\n",
+           delivery_stats.frames, delivery_stats.writes,
+           delivery_stats.frames > 0 ? (double)delivery_stats.writes / delivery_stats.frames : 0.0);
+    printf(" - Vaciados: %lu por inactividad, %lu por latencia, %lu por tamaño, %lu reintentos\n",
+           delivery_stats.flushes[FLUSH_IDLE], delivery_stats.flushes[FLUSH_LATENCY],
+           delivery_stats.flushes[FLUSH_SIZE], delivery_stats.flushes[FLUSH_RETRY]);
+    printf(" - Descartados por bandeja llena: %lu\n", delivery_stats.dropped);
+    printf(" - Llamadas al sistema (%s): %lu para entregar (%.3f por mensaje), %lu para recibir comandos\n",
+           delivery_ring.fd != -1 ? "io_uring" : "poll", delivery_stats.syscalls,
+           delivery_stats.frames > 0 ? (double)delivery_stats.syscalls / delivery_stats.frames : 0.0, ingest_syscalls);
+    printf(" - Latencia máxima de agrupación: %ld us, lote máximo: %zu bytes\n", max_batch_latency_us, batch_max_bytes);
+    static const char *lane_names[LANES] = { "control", "alta", "normal", "baja" };
+    for (int l = 0; l < LANES; l++) {
+        printf(" - Carril %s: %lu encolados, %lu escritos, espera en la bandeja media %.1f us, máxima %lu us\n",
+               lane_names[l], delivery_stats.lane_frames[l], delivery_stats.lane_delivered[l],
+               delivery_stats.lane_delivered[l] > 0 ? (double)delivery_stats.lane_wait_us[l] / delivery_stats.lane_delivered[l] : 0.0,
+               delivery_stats.lane_wait_max_us[l]);
+    }
+    printf(" - Escrituras con un carril adelantado tras ceder %d seguidas: %lu\n", starvation_writes, delivery_stats.promotions);
+    printf("Repartos: %lu (%lu en paralelo con %d hilos a partir de %d destinatarios), media %.1f us, máximo %.1f us\n",
+           delivery_stats.publishes, delivery_stats.parallel_publishes, fanout_threads + 1, fanout_min_width,
+           delivery_stats.publishes > 0 ? delivery_stats.publish_ns / 1000.0 / delivery_stats.publishes : 0.0,
+           delivery_stats.publish_max_ns / 1000.0);
+    printf("Filtros: %lu evaluaciones, %lu entregas evitadas\n", delivery_stats.filter_evaluations, delivery_stats.filtered_out);
+    CompressionStats *z = &compression_stats;
+    printf("Compresión: archivo %lu bloques, %llu -> %llu bytes con diccionarios (%.2fx), %lu tópicos sin comprimir por no compensar, %.1f us de CPU\n",
+           z->disk_blocks, z->disk_raw_bytes, z->disk_bytes,
+           z->disk_bytes > 0 ? (double)z->disk_raw_bytes / z->disk_bytes : 0.0, z->disk_skipped, z->disk_ns / 1000.0);
+    printf(" - Reenvíos: %lu comprimidos, %llu -> %llu bytes con diccionarios (%.2fx), %lu sin comprimir por no compensar, %.1f us de CPU\n",
+           z->replay_blocks, z->replay_raw_bytes, z->replay_bytes,
+           z->replay_bytes > 0 ? (double)z->replay_raw_bytes / z->replay_bytes : 0.0, z->replay_skipped, z->replay_ns / 1000.0);
+    printf(" - Diccionarios enviados: %lu (%llu bytes)\n", z->dictionary_sends, z->dictionary_bytes);
+    if (repl_file != NULL) {
+        printf("Replicación: %lu registros escritos para el manager en espera, registro reiniciado %lu veces\n",
+               replication_stats.records, replication_stats.rotations);
+    } else if (standby_mode) {
+        printf("Replicación (en espera): %lu registros aplicados, retraso %.3f ms (máximo %.3f ms), %ld bytes pendientes\n",
+               replication_stats.records, replication_stats.lag_ns / 1e6, replication_stats.max_lag_ns / 1e6,
+               replication_stats.behind_bytes);
+    } else if (replication_stats.records > 0) {
+        printf("Replicación: relevo tomado %.1f ms después del último registro del principal (%lu registros aplicados)\n",
+               replication_stats.failover_ms, replication_stats.records);
+    }
+}
+
+// Función para ejecutar un comando del administrador
+void dispatch_admin(char *input) {
+    // Comando remove <user>
+    if (strncmp(input, "remove ", 7) == 0) {
+        char username[USERNAME_LEN];
+        sscanf(input + 7, "%s", username);
+        pthread_mutex_lock(&mutex);
+        remove_client(username); // Eliminar cliente
+        pthread_mutex_unlock(&mutex);
+    }
+    // Comando close
+    else if (strcmp(input, "close") == 0) {
+        close_all_connections(); 
+        unlink(server_pipe_path); 
+        exit(0); 
+    }
+    // Comando users
+    else if (strcmp(input, "users") == 0) {
+        pthread_mutex_lock(&mutex);
+        printf("Lista de usuarios conectados:\n");
+        list_connected_users();
+        pthread_mutex_unlock(&mutex);
+    }
+    // Comando topics
+    else if (strcmp(input, "topics") == 0) {
+        pthread_mutex_lock(&mutex);
+        printf("Tópicos:\n");
+        if (topic_count == 0) {
+            printf("No se encontraron tópicos para listar.\n");
+        }
+        else{
+            for (int i = 0; i < topic_count; i++) {
+            printf(" - %s (Suscriptores: %d)", topics[i].name, topics[i].subscriber_count);
+            if (topics[i].limit.rate > 0) {
+                printf(" [límite %.2f/s, ráfaga %.0f, rechazados %lu]", topics[i].limit.rate, topics[i].limit.burst, topics[i].limit.rejected);
+            }
+            if (topics[i].lane != LANE_NORMAL) {
+                printf(" [prioridad %s]", topics[i].lane == LANE_HIGH ? "alta" : "baja");
+            }
+            printf("\n");
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    // Comando lock <topic>
+    else if (strncmp(input, "lock ", 5) == 0){
+        char topic[TOPIC_NAME_LEN];
+        sscanf(input + 5, "%s", topic);
+        pthread_mutex_lock(&mutex);
+        lock_topic(topic);
+        pthread_mutex_unlock(&mutex);
+    }
+    // Comando unlock <topic>
+    else if (strncmp(input, "unlock ", 7) == 0){
+        char topic[TOPIC_NAME_LEN];
+        sscanf(input + 7, "%s", topic);
+        pthread_mutex_lock(&mutex);
+        unlock_topic(topic);
+        pthread_mutex_unlock(&mutex);
+    }
+    // Comando limit <topic> <mensajes/s> <ráfaga>
+    else if (strncmp(input, "limit ", 6) == 0) {
+        char topic[TOPIC_NAME_LEN];
+        double rate = 0, burst = 1;
+        if (sscanf(input + 6, "%20s %lf %lf", topic, &rate, &burst) < 2) {
+            printf("Uso: limit <topic> <mensajes/s> [ráfaga]\n");
+        } else {
+            pthread_mutex_lock(&mutex);
+            limit_topic(topic, rate, burst);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+    // Comando userlimit <user|*> <mensajes/s> <ráfaga>
+    else if (strncmp(input, "userlimit ", 10) == 0) {
+        char username[USERNAME_LEN];
+        double rate = 0, burst = 1;
+        if (sscanf(input + 10, "%256s %lf %lf", username, &rate, &burst) < 2) {
+            printf("Uso: userlimit <user|*> <mensajes/s> [ráfaga]\n");
+        } else {
+            pthread_mutex_lock(&mutex);
+            limit_user(username, rate, burst);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+    // Comando durable <topic> on|off
+    else if (strncmp(input, "durable ", 8) == 0) {
+        char topic[TOPIC_NAME_LEN], mode[8] = "";
+        sscanf(input + 8, "%20s %7s", topic, mode);
+        if (strcmp(mode, "on") != 0 && strcmp(mode, "off") != 0) {
+            printf("Uso: durable <topic> on|off\n");
+        } else {
+            pthread_mutex_lock(&mutex);
+            set_topic_durability(topic, strcmp(mode, "on") == 0);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+    // Comando priority <topic> high|normal|low
+    else if (strncmp(input, "priority ", 9) == 0) {
+        char topic[TOPIC_NAME_LEN], mode[8] = "";
+        sscanf(input + 9, "%20s %7s", topic, mode);
+        int lane = strcmp(mode, "high") == 0 ? LANE_HIGH : strcmp(mode, "normal") == 0 ? LANE_NORMAL :
+                   strcmp(mode, "low") == 0 ? LANE_LOW : -1;
+        if (lane == -1) {
+            printf("Uso: priority <topic> high|normal|low\n");
+        } else {
+            pthread_mutex_lock(&mutex);
+            set_topic_priority(topic, lane);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+    // Comando compact <topic> on|off
+    else if (strncmp(input, "compact ", 8) == 0) {
+        char topic[TOPIC_NAME_LEN], mode[8] = "";
+        sscanf(input + 8, "%20s %7s", topic, mode);
+        if (strcmp(mode, "on") != 0 && strcmp(mode, "off") != 0) {
+            printf("Uso: compact <topic> on|off\n");
+        } else {
+            pthread_mutex_lock(&mutex);
+            set_topic_compaction(topic, strcmp(mode, "on") == 0);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+    // Comando compress <topic> on|off
+    else if (strncmp(input, "compress ", 9) == 0) {
+        char topic[TOPIC_NAME_LEN], mode[8] = "";
+        sscanf(input + 9, "%20s %7s", topic, mode);
+        if (strcmp(mode, "on") != 0 && strcmp(mode, "off") != 0) {
+            printf("Uso: compress <topic> on|off\n");
+        } else {
+            pthread_mutex_lock(&mutex);
+            set_topic_compression(topic, strcmp(mode, "on") == 0);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+    // Comando show <topic> [offset] [limit] [user <username>] [age <segundos>]
+    else if (strncmp(input, "show ", 5) == 0) {
+        char topic[TOPIC_NAME_LEN] = "";
+        char sender[USERNAME_LEN] = "";
+        int offset = 0, limit = SHOW_PAGE_SIZE, max_age = 0;
+        int consumed = 0;
+        sscanf(input + 5, "%20s%n", topic, &consumed);
+
+        // Argumentos opcionales: primero la paginación y después los filtros
+        char *args = input + 5 + consumed;
+        int value, n;
+        if (sscanf(args, "%d%n", &value, &n) == 1) {
+            offset = value > 0 ? value : 0;
+            args += n;
+            if (sscanf(args, "%d%n", &value, &n) == 1) {
+                limit = value > 0 ? value : SHOW_PAGE_SIZE;
+                args += n;
+            }
+        }
+        char filter[8];
+        while (sscanf(args, "%7s%n", filter, &n) == 1) {
+            args += n;
+            if (strcmp(filter, "user") == 0 && sscanf(args, "%256s%n", sender, &n) == 1) {
+                args += n;
+            } else if (strcmp(filter, "age") == 0 && sscanf(args, "%d%n", &max_age, &n) == 1) {
+                args += n;
             } else {
-                perror("Variable de entorno MSG_FICH no configurada");
+                printf("Filtro desconocido: %s\n", filter);
+                break;
             }
         }
 
-        // Imprimir el mensaje en la consola
-        printf("Mensaje de %s enviado al tópico %s\n", request->username, request->topic);
+        pthread_mutex_lock(&mutex);
+        show_messages(topic, offset, limit, sender[0] != '\0' ? sender : NULL, max_age);
+        pthread_mutex_unlock(&mutex);
+    }
+    // Comando mem
+    else if (strcmp(input, "mem") == 0) {
+        pthread_mutex_lock(&mutex);
+        print_memory_usage();
+        pthread_mutex_unlock(&mutex);
+    }
+    // Comando stats
+    else if (strcmp(input, "stats") == 0) {
+        pthread_mutex_lock(&mutex);
+        print_delivery_stats();
+        pthread_mutex_unlock(&mutex);
+    }
+    else {
+        printf("Comando desconocido: %s\n", input);
+    }
+
+    // Entregar las notificaciones generadas por el comando
+    pthread_mutex_lock(&mutex);
+    flush_all_clients(FLUSH_IDLE);
+    pthread_mutex_unlock(&mutex);
+}
+
+// Función para manejar el envío de comandos del manager
+void* command_sender(void* arg) {
+    struct sigaction sa;
+    sa.sa_handler = thread_signal_handler; // registrar el manejador de señales
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGUSR1, &sa, NULL);  // asignar el manejador para SIGUSR1
+
+    char input[256];
+    while (!terminate_thread) {     
+        if (fgets(input, sizeof(input), stdin) == NULL) {
+            if (terminate_thread){
+                printf("Recibida señal de terminación\n");
+                break; 
+            }  
+            continue;
+        }
+        input[strcspn(input, "\n")] = 0; // eliminar salto de línea para que se pueda procesar bien el comando
+
+        // El manager en espera solo admite consultas: su estado debe ser el del principal
+        if (standby_mode && strcmp(input, "close") != 0 && strcmp(input, "users") != 0 && strcmp(input, "topics") != 0 &&
+            strcmp(input, "mem") != 0 && strcmp(input, "stats") != 0 && strncmp(input, "show ", 5) != 0) {
+            printf("Manager en espera: solo se admiten consultas (users, topics, show, mem, stats) y close.\n");
+            continue;
+        }
 
-        // Enviar una respuesta al cliente que envió el mensaje
-        send_response(request->client_pipe, "Mensaje enviado con éxito.");
-    } else {
-        send_response(request->client_pipe, "Error: máximo de mensajes alcanzado.");
+        // close espera al hilo del lifetime, que podría estar esperando admin_mutex
+        int ordered = strcmp(input, "close") != 0;
+        if (ordered) {
+            pthread_mutex_lock(&admin_mutex);
+        }
+        trace_admin(input);
+        dispatch_admin(input);
+        if (ordered) {
+            pthread_mutex_unlock(&admin_mutex);
+        }
     }
+    pthread_exit(NULL); // terminar el hilo
 }
 
 
+const char *trace_path = NULL; // Archivo de traza a grabar (--trace)
+const char *replay_path = NULL; // Archivo de traza a reproducir (--replay)
+const char *repl_path = NULL; // Registro de replicación a escribir (--repl)
+const char *standby_path = NULL; // Registro de replicación a seguir en espera (--standby)
+double replay_speed = 1.0; // Factor de velocidad de la reproducción (0 = máxima)
 
-// Función para cargar los mensajes cuyo lifetime sea mayor a 0 desde el archivo
-int load_messages() {
-    const char* msg_file = getenv("MSG_FICH"); // obtener el archivo desde la variable de entorno
-    if (!msg_file) {
-        perror("Variable de entorno MSG_FICH no configurada");
-        return 0;
+// Función para leer las opciones de la línea de comandos
+void parse_options(int argc, char *argv[]) {
+    static struct option options[] = {
+        { "batch-us", required_argument, NULL, 'l' },
+        { "batch-bytes", required_argument, NULL, 'b' },
+        { "trace", required_argument, NULL, 't' },
+        { "replay", required_argument, NULL, 'r' },
+        { "speed", required_argument, NULL, 's' },
+        { "fanout-threads", required_argument, NULL, 'f' },
+        { "fanout-width", required_argument, NULL, 'w' },
+        { "shard", required_argument, NULL, 'h' },
+        { "repl", required_argument, NULL, 'p' },
+        { "standby", required_argument, NULL, 'y' },
+        { "failover-ms", required_argument, NULL, 'o' },
+        { "io", required_argument, NULL, 'i' },
+        { "starvation-writes", required_argument, NULL, 'g' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                max_batch_latency_us = atol(optarg);
+                break;
+            case 'b':
+                batch_max_bytes = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'r':
+                replay_path = optarg;
+                replay_mode = 1;
+                break;
+            case 's':
+                replay_speed = atof(optarg);
+                break;
+            case 'f':
+                fanout_threads = atoi(optarg);
+                break;
+            case 'w':
+                fanout_min_width = atoi(optarg);
+                break;
+            case 'h':
+                if (sscanf(optarg, "%d/%d", &shard_index, &shard_count) != 2 || shard_count < 1 ||
+                    shard_count > MAX_SHARDS || shard_index < 0 || shard_index >= shard_count) {
+                    fprintf(stderr, "Shard no válido '%s' (formato i/N con N <= %d).\n", optarg, MAX_SHARDS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                repl_path = optarg;
+                break;
+            case 'y':
+                standby_path = optarg;
+                standby_mode = 1;
+                replay_mode = 1; // sin entregas ni señales reales hasta tomar el relevo
+                break;
+            case 'o':
+                failover_ms = atol(optarg);
+                break;
+            case 'i':
+                if (strcmp(optarg, "uring") == 0) {
+                    io_backend = IO_URING;
+                } else if (strcmp(optarg, "poll") == 0) {
+                    io_backend = IO_POLL;
+                } else {
+                    fprintf(stderr, "Mecanismo de entrada/salida no válido '%s' (uring o poll).\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'g':
+                starvation_writes = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Uso: %s [--batch-us <microsegundos>] [--batch-bytes <bytes>] [--trace <fichero>]\n"
+                                "       [--fanout-threads <hilos>] [--fanout-width <destinatarios>] [--shard <i>/<N>]\n"
+                                "       [--repl <registro> | --standby <registro> [--failover-ms <ms>]] [--io uring|poll]\n"
+                                "       [--starvation-writes <escrituras>]\n"
+                                "       %s --replay <fichero> [--speed <factor, 0 = máxima>]\n", argv[0], argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (max_batch_latency_us < 0) {
+        max_batch_latency_us = 0;
+    }
+    if (batch_max_bytes == 0) {
+        batch_max_bytes = 1; // sin agrupación por tamaño
+    }
+    if (fanout_min_width < 1) {
+        fanout_min_width = 1;
+    }
+    if (starvation_writes < 1) {
+        starvation_writes = 1;
+    }
+    if (standby_path != NULL && (repl_path != NULL || replay_path != NULL)) {
+        fprintf(stderr, "--standby no se puede combinar con --repl ni con --replay.\n");
+        exit(EXIT_FAILURE);
     }
+    if (failover_ms < 1) {
+        failover_ms = 1;
+    }
+    shard_ring_init(&shard_ring, shard_count);
+    server_pipe_name(server_pipe_path, sizeof(server_pipe_path), shard_index, shard_count);
+}
 
-    FILE* file = fopen(msg_file, "r"); // abrir el archivo para lectura
-    if (!file) {
-        perror("Error al abrir el archivo de mensajes para lectura");
-        return 0;
+// Función para comprobar si un tópico pertenece a este manager en el modo repartido
+int owns_topic(const char *topic_name) {
+    return shard_count <= 1 || shard_of(&shard_ring, topic_name) == shard_index;
+}
+
+// Función para ejecutar un comando recibido de un cliente (con el mutex cogido)
+void dispatch_command(Response *msg) {
+    // Los comandos sobre un tópico solo los atiende el shard dueño del tópico
+    int topic_command = msg->command_type == 1 || msg->command_type == 4 || msg->command_type == 5 || msg->command_type == 7;
+    if (topic_command && !owns_topic(msg->topic)) {
+        char res[128];
+        snprintf(res, sizeof(res), "Error: el tópico pertenece al shard %d.", shard_of(&shard_ring, msg->topic));
+        send_response(msg->client_pipe, res);
+        return;
     }
 
-    int loaded_count = 0;
-    while (fscanf(file, "%s %s %d %[^\n]", 
-                   messages[loaded_count].topic, 
-                   messages[loaded_count].username, 
-                   &messages[loaded_count].lifetime, 
-                   messages[loaded_count].message) == 4) {
-        // Solo cargar los mensajes cuyo lifetime sea mayor a 0
-        if (messages[loaded_count].lifetime > 0) {
-            // Verificar si el tópico ya existe
-            int topic_exists = 0;
-            for (int i = 0; i < topic_count; i++) {
-                if (strcmp(topics[i].name, messages[loaded_count].topic) == 0) {
-                    topic_exists = 1;
-                    topics[i].has_active_messages = 1; // marcamos que el tópico tiene mensajes activos
-                    break;
+    // Identificar al cliente con su identificador de sesión en O(1). Solo el inicio de sesión llega sin
+    // él: el cliente no envía más comandos hasta recibirlo, así nadie actúa con el nombre de otro
+    int client_index = -1;
+    if (msg->command_type != 0) {
+        client_index = resolve_session(msg->session);
+        if (client_index == -1) {
+            printf("Sesión %u de '%s' no válida o caducada: comando %d rechazado.\n", msg->session, msg->username, msg->command_type);
+            send_response(msg->client_pipe, "Error: sesión no válida o caducada.");
+            return;
+        }
+        strncpy(msg->username, clients[client_index].username, sizeof(msg->username) - 1);
+        msg->username[sizeof(msg->username) - 1] = '\0';
+    }
+
+    switch (msg->command_type) {
+        // Mensaje de conexión
+        case 0: 
+            char res[512];
+            if (client_count < MAX_USERS) {
+                int duplicate_found = 0; 
+                // Verificar si el nombre de usuario ya está en uso
+                if (find_client(msg->username) != -1) {
+                    printf("ERR: Username '%s' is already in use.\n", msg->username);
+                    duplicate_found = 1;
+                    sprintf(res, "ERR: Username '%s' is already in use.\n", msg->username);
+                    send_response(msg->client_pipe, res);
+                    reject_client(msg->pid); // cierra el nuevo cliente
+                }
+
+                // Si no se encuentra un duplicado, agregar al nuevo cliente
+                if (duplicate_found == 0) {
+                    if (msg->username[0] != '\0') { // verificar que el nombre no esté vacío
+                        sprintf(res, "Bienvenido, %s", msg->username);
+                        if (shard_index == 0) { // el inicio de sesión llega a todos los shards, solo saluda el primero
+                            send_response(msg->client_pipe, res);
+                        }
+                        // Cada shard entrega su propio identificador de sesión por la pipe de ese shard. Al aplicar
+                        // el registro de replicación o una traza llega el que entregó el principal
+                        uint32_t token = add_client(msg->client_pipe, msg->username, msg->pid, msg->session);
+                        msg->session = token;
+                        if (token != 0) {
+                            // El cliente anuncia en el texto del inicio de sesión si acepta reenvíos comprimidos
+                            clients[resolve_session(token)].accepts_compressed = strcmp(msg->message, LZ_CAPABILITY) == 0;
+                        }
+                        sprintf(res, "SESION %u", token);
+                        send_response(msg->client_pipe, res);
+                    } else {
+                        printf("ERR: Invalid username.\n");
+                        send_response(msg->client_pipe, "ERR: Invalid username.\n");
+                        reject_client(msg->pid); // cierra el nuevo cliente
+                    }
                 }
+            } else {            
+                printf("ERR: Max number of users reached (%d).\n", MAX_USERS);
+                sprintf(res, "ERR: Max number of users reached (%d).\n", MAX_USERS);
+                send_response(msg->client_pipe, res);
+                reject_client(msg->pid); // cierra el nuevo cliente
+            }
+        break;
+
+        // Manejo de la creación de un tópico
+        case 1: 
+            msg->message[TAM_MSG - 1] = '\0';
+            subscribe_topic(msg->topic, msg->client_pipe, msg->username, msg->message, msg->dictionary);
+            break;
+
+        // Manejo de listar los topicos
+        case 2:
+            printf("Listar tópicos para el usuario '%s'.\n", msg->username);
+            list_topics(msg->client_pipe);
+            break;
+
+        // Manejo del comando exit del cliente
+        case 3:
+            printf("Cliente '%s' ha salido.\n", msg->username);
+            if (client_index != -1) {
+                remove_client_at(client_index);
+            } else {
+                printf("Cliente '%s' no encontrado.\n", msg->username);
+            }
+            break;
+            
+        // Manejo de la desuscripcion de un cliente en un topico
+        case 4:
+            printf("El usuario '%s'se ha desuscrito del tópico '%s'\n", msg->username, msg->topic);
+            unsubscribe_topic(msg->topic, msg->client_pipe, msg->username);
+            break;
+
+        // Manejo del envío de un mensaje y almacenamiento en un archivo si es persistente
+        case 5:
+            send_message(msg, client_index);
+            break;
+
+        // Manejo del CTRL+C del cliente
+        case 6:
+            handle_ctrlc(msg->username, client_index);
+            break;
+
+        // Manejo de la suscripción a un grupo de consumidores
+        case 7: {
+            char group_name[GROUP_NAME_LEN] = "";
+            char policy[8] = "rr";
+            sscanf(msg->message, "%20s %7s", group_name, policy);
+            subscribe_group(msg->topic, group_name, strcmp(policy, "lqd") == 0 ? GROUP_LEAST_QUEUE : GROUP_ROUND_ROBIN,
+                            msg->client_pipe, msg->username);
+            break;
+        }
+
+        // Manejo de la vigilancia del directorio de tópicos
+        case 8:
+            watch_directory(msg->client_pipe, client_index);
+            break;
+
+        case 9:
+            unwatch_directory(msg->client_pipe, client_index);
+            break;
+            
+        default:
+            // Enviar respuesta de comando no reconocido
+            send_response(msg->client_pipe, "Comando no reconocido.");
+            printf("Comando no reconocido: tipo %d\n", msg->command_type);
+            break;
+    }
+}
+
+
+// Función para aplicar un registro de una traza o del registro de replicación
+void apply_record(int kind, Response *msg) {
+    switch (kind) {
+        case TRACE_CLIENT:
+            pthread_mutex_lock(&mutex);
+            dispatch_command(msg);
+            flush_all_clients(FLUSH_IDLE);
+            pthread_mutex_unlock(&mutex);
+            break;
+
+        case TRACE_ADMIN:
+            dispatch_admin(msg->message);
+            break;
+
+        case TRACE_REAP: {
+            pthread_mutex_lock(&mutex);
+            int i = find_client(msg->username);
+            if (i != -1) {
+                drop_client(i);
+                drop_subscriptions(msg->username);
             }
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+
+        case TRACE_SESSION:
+            pthread_mutex_lock(&mutex);
+            restore_client(msg);
+            pthread_mutex_unlock(&mutex);
+            break;
+
+        case TRACE_DIRECTORY:
+            pthread_mutex_lock(&mutex);
+            directory_seq = strtoull(msg->message, NULL, 10);
+            pthread_mutex_unlock(&mutex);
+            break;
 
-            // Si el tópico no existe, agregarlo
-            if (!topic_exists) {
-                // Añadir un nuevo tópico al arreglo
-                strcpy(topics[topic_count].name, messages[loaded_count].topic);
-                topics[topic_count].has_active_messages = 1; // tópico con mensaje activo
-                topic_count++;
+        case TRACE_RETAINED:
+            pthread_mutex_lock(&mutex);
+            if ((find_topic(msg->topic) != -1 || create_topic(msg->topic) != -1) &&
+                store_message(msg->topic, msg->username, msg->key, msg->lifetime, msg->message, time(NULL)) != NULL) {
+                rebuild_topic_indexes();
             }
+            pthread_mutex_unlock(&mutex);
+            break;
 
-            loaded_count++; // incrementar el contador si el mensaje es válido
-        }
+        default:
+            break; // latidos
     }
-
-    fclose(file); // cerrar el archivo después de leer
-    return loaded_count; // retornar el número de mensajes cargados
 }
 
-
-// Función que maneja la señal SIGUSR1 (eliminación de hilos)
-void thread_signal_handler(int sig) {
-    if (sig == SIGUSR1) {
-        terminate_thread = 1;
+// Función para abrir el registro de replicación cuando el principal ya ha escrito su cabecera
+FILE *standby_open(const char *path) {
+    while (1) {
+        FILE *file = fopen(path, "rb");
+        if (file != NULL) {
+            char magic[8];
+            uint32_t version;
+            if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0 &&
+                fread(&version, sizeof(version), 1, file) == 1 && version == TRACE_VERSION) {
+                return file;
+            }
+            fclose(file);
+        }
+        usleep(REPL_POLL_US);
     }
 }
 
-// Función para disminuir el lifetime de los mensajes cada segundo y almacenar solamente los mensajes persistentes en el archivo
-void* manage_lifetime(void* arg) {
-    struct sigaction sa;
-    sa.sa_handler = thread_signal_handler;  // registrar el manejador de señales
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGUSR1, &sa, NULL);  // asignar el manejador para SIGUSR1
-
-    // Cargar los mensajes si se reinicia el manager y había alguno en el archivo
-    message_count = load_messages(); // cargar mensajes desde el archivo
+// Función para comprobar si el principal ha sustituido el registro que se está siguiendo por uno nuevo
+int standby_rotated(const char *path, FILE *file) {
+    struct stat current, followed;
+    return stat(path, &current) == 0 && fstat(fileno(file), &followed) == 0 &&
+           (current.st_ino != followed.st_ino || current.st_dev != followed.st_dev);
+}
 
-    while (!terminate_thread) {
-        sleep(1);  // esperar 1 segundo para actualizar el archivo
+// Función del manager en espera: aplica el registro del principal hasta que este desaparece.
+// Devuelve 1 si debe tomar el relevo y 0 si el principal se cerró de forma ordenada. Solo se toma el
+// relevo con el cerrojo del registro: si el principal deja de enviar latidos sin soltarlo, se le detiene
+// con SIGKILL y se espera al cerrojo, así nunca hay dos managers atendiendo a los clientes
+int standby_follow(const char *path) {
+    // Esperar a que el principal cree el registro y escriba la cabecera
+    FILE *file = standby_open(path);
+    printf("En espera: siguiendo el registro de replicación '%s'.\n", path);
 
-        // Decrementar el lifetime de los mensajes
-        for (int i = 0; i < message_count; i++) {
-            if (messages[i].lifetime > 0) {
-                messages[i].lifetime--;  // decrementar el lifetime
+    struct timespec last_record;
+    clock_gettime(CLOCK_MONOTONIC, &last_record);
+    int primary_gone = 0;
+    pid_t primary_pid = 0; // PID del principal según sus latidos
+    int fenced = 0; // Indicador de que ya se detuvo al principal colgado
+    while (1) {
+        long offset = ftell(file);
+        uint64_t timestamp;
+        int kind;
+        Response msg;
+        if (trace_read(file, &timestamp, &kind, &msg)) {
+            clock_gettime(CLOCK_MONOTONIC, &last_record);
+            uint64_t now = (uint64_t)last_record.tv_sec * 1000000000ULL + last_record.tv_nsec;
+            replication_stats.lag_ns = now > timestamp ? now - timestamp : 0;
+            if (replication_stats.lag_ns > replication_stats.max_lag_ns) {
+                replication_stats.max_lag_ns = replication_stats.lag_ns;
             }
-        }
-
-        // Eliminar mensajes con lifetime == 0
-        int new_message_count = 0;
-        for (int i = 0; i < message_count; i++) {
-            if (messages[i].lifetime > 0) {
-                messages[new_message_count] = messages[i];
-                new_message_count++;
+            replication_stats.records++;
+            if (kind == TRACE_HEARTBEAT) {
+                primary_pid = msg.pid;
             }
-        }
-        message_count = new_message_count;  // actualizar el contador de mensajes
 
-        // Comprobar si algún tópico tiene mensajes activos
-        for (int i = 0; i < topic_count; i++) {
-            int topic_has_active_messages = 0;
-            for (int j = 0; j < message_count; j++) {
-                if (strcmp(topics[i].name, messages[j].topic) == 0 && messages[j].lifetime > 0) {
-                    topic_has_active_messages = 1;
-                    break;
-                }
+            if (kind == TRACE_ADMIN && strcmp(msg.message, "close") == 0) {
+                printf("El principal se ha cerrado de forma ordenada.\n");
+                fclose(file);
+                return 0;
             }
-            topics[i].has_active_messages = topic_has_active_messages;
+            apply_record(kind, &msg);
+            continue;
         }
 
-        // Eliminar tópicos sin mensajes activos y sin suscriptores
-        for (int i = 0; i < topic_count; i++) {
-            if (!topics[i].has_active_messages && topics[i].subscriber_count == 0) {
-                for (int j = i; j < topic_count - 1; j++) {
-                    topics[j] = topics[j + 1];  // desplazar los tópicos
-                }
-                topic_count--;  // reducir el contador de tópicos
-                i--;  // ajustar el índice
-            }
+        // Sin registros completos: volver al inicio del registro a medias y comprobar el estado del principal
+        fseek(file, offset, SEEK_SET);
+        if (primary_gone) {
+            break; // ya se aplicó todo lo que escribió antes de morir
         }
-
-        // Reescribir el archivo solo con los mensajes con lifetime > 0
-        const char* msg_file = getenv("MSG_FICH");
-        if (!msg_file) {
-            perror("Variable de entorno MSG_FICH no configurada");
-            return NULL;
+        struct stat st;
+        if (fstat(fileno(file), &st) == 0) {
+            replication_stats.behind_bytes = st.st_size - offset;
         }
 
-        FILE* file = fopen(msg_file, "w");
-        if (file) {
-            for (int i = 0; i < message_count; i++) {
-                if (messages[i].lifetime > 0) {
-                    fprintf(file, "%s %s %d %s\n",
-                            messages[i].topic,
-                            messages[i].username,
-                            messages[i].lifetime,
-                            messages[i].message);
-                }
-            }
+        // El principal mantiene un cerrojo sobre el registro mientras vive. Al reiniciar el registro
+        // suelta el del anterior después de sustituirlo: si el archivo ha cambiado, se sigue el nuevo
+        // partiendo de un estado vacío (el registro nuevo empieza con el estado completo)
+        int unlocked = flock(fileno(file), LOCK_EX | LOCK_NB) == 0;
+        if (standby_rotated(path, file)) {
             fclose(file);
-        } else {
-            perror("Error al abrir el archivo de mensajes para reescritura");
+            file = standby_open(path);
+            pthread_mutex_lock(&mutex);
+            reset_state();
+            pthread_mutex_unlock(&mutex);
+            clock_gettime(CLOCK_MONOTONIC, &last_record);
+            continue;
+        }
+        if (unlocked) {
+            printf("El principal ha terminado: aplicando los últimos registros.\n");
+            primary_gone = 1;
+            continue;
+        }
+        if (!fenced && elapsed_us(&last_record) > failover_ms * 1000L) {
+            printf("Sin latidos del principal durante %ld ms: se detiene el principal (PID %d).\n", failover_ms, primary_pid);
+            if (primary_pid > 0 && kill(primary_pid, SIGKILL) == -1) {
+                perror("Error al detener el principal");
+            }
+            fenced = 1; // el relevo llega cuando el núcleo suelta su cerrojo
         }
+        usleep(REPL_POLL_US);
     }
-    pthread_exit(NULL); // finaliza el hilo
+    fclose(file);
+    replication_stats.failover_ms = elapsed_us(&last_record) / 1000.0;
+    return 1;
 }
 
-// Función para eliminar un cliente de la sesión actual
-void remove_client(const char *username) {
+// Función para tomar el relevo del principal: el estado replicado pasa a atender a los clientes
+int promote_standby(int *server_fd) {
+    pthread_mutex_lock(&mutex);
+    standby_mode = 0;
+    replay_mode = 0; // a partir de ahora las entregas y las señales son reales
     for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].username, username) == 0) {
-            // Enviar la señal SIGTERM al proceso del cliente para finalizar su proceso
-            if (clients[i].pid > 0) {
-                kill(clients[i].pid, SIGTERM);
-                printf("Se envió SIGTERM a %s (PID: %d)\n", username, clients[i].pid);
-            }
-            // Desplazar elementos hacia atrás para eliminar al cliente
-            for (int j = i; j < client_count - 1; j++) {
-                clients[j] = clients[j + 1];
-            }
-            client_count--; // reducir el contador de clientes
-            printf("Cliente '%s' ha sido eliminado de la lista de conectados.\n", username);
-            char formatted_message[100];
-            snprintf(formatted_message, sizeof(formatted_message), "El  cliente '%s' ha sido eliminado de la lista de conectados.\n", username);  
-            // Notificar a los clientes conectados
-            for (int i = 0; i < client_count; i++) {
-                send_response(clients[i].client_pipe, formatted_message);
-            }
-            return;
-        }
+        clear_outbox(&clients[i]);
+        clients[i].is_blocked = 0;
     }
-    printf("Cliente '%s' no encontrado.\n", username);
-}
+    pthread_mutex_unlock(&mutex);
 
-// Función para mostrar los mensajes de un topico
-void show_messages(const char *topic_name) {
-    // Comprobar si el tópico existe
-    if (!topic_exists(topic_name)) {
-        printf("El tópico '%s' no existe.\n", topic_name);
-        return;
+    // La pipe del servidor sigue existiendo si el principal murió sin limpiar
+    if (access(server_pipe_path, F_OK) != 0) {
+        mkfifo(server_pipe_path, 0600);
+    }
+    if (*server_fd == -1) {
+        *server_fd = open(server_pipe_path, O_RDWR);
+        if (*server_fd == -1) {
+            perror("Error al abrir la pipe del servidor");
+            return -1;
+        }
     }
+    printf("Relevo tomado: atendiendo a %d clientes y %d tópicos (%.1f ms desde el último registro del principal).\n",
+           client_count, topic_count, replication_stats.failover_ms);
+    return 0;
+}
 
-    int found_messages = 0; // contador para verificar si hay mensajes
-    const char *msg_file = getenv("MSG_FICH");  // obtener el nombre del archivo desde la variable de entorno
+// Función para comparar latencias al ordenarlas
+int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
 
-    if (msg_file == NULL) {
-        printf("La variable de entorno MSG_FICH no está configurada.\n");
-        return;
+// Función para obtener el nombre de un tipo de comando en el informe de latencias
+const char *command_name(int type) {
+    static const char *names[] = { "login", "subscribe", "topics", "exit", "unsubscribe", "msg", "ctrl-c", "group", "watch", "unwatch" };
+    if (type >= 0 && type < (int)(sizeof(names) / sizeof(names[0]))) {
+        return names[type];
     }
+    return type == MAX_COMMAND_TYPES - 1 ? "admin" : "otro";
+}
 
-    FILE *file = fopen(msg_file, "r");  // abrir el archivo en modo lectura
+// Función para reproducir una traza contra la lógica de despacho y medir la latencia de cada comando
+void replay_trace(const char *path, double speed) {
+    FILE *file = fopen(path, "rb");
     if (file == NULL) {
-        perror("Error al abrir el archivo de mensajes");
+        perror("Error al abrir el archivo de traza");
+        return;
+    }
+    char magic[8];
+    uint32_t version;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+        fread(&version, sizeof(version), 1, file) != 1 || version != TRACE_VERSION) {
+        printf("El archivo '%s' no es una traza válida.\n", path);
+        fclose(file);
         return;
     }
 
-    char line[512];  // buffer para leer cada línea del archivo
-    while (fgets(line, sizeof(line), file)) {
-        StoredMessage msg;
-        // Leer los datos de la línea
-        int n = sscanf(line, "%255s %255s %d %300[^\n]", msg.topic, msg.username, &msg.lifetime, msg.message);
-        if (n != 4) {
-            continue;  // Si la línea no tiene el formato correcto, pasar a la siguiente
-        }
+    // Latencias de cada tipo de comando (el último hueco es para los comandos del administrador)
+    uint64_t *latencies[MAX_COMMAND_TYPES] = { NULL };
+    size_t counts[MAX_COMMAND_TYPES] = { 0 };
+    size_t capacities[MAX_COMMAND_TYPES] = { 0 };
+
+    struct timespec start, before, after;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t timestamp;
+    int kind;
+    Response msg;
+    size_t total = 0;
+    uint64_t next_tick = 1000000000ULL; // Instante de la traza de la siguiente pasada del lifetime
 
-        // Comprobar si el mensaje pertenece al tópico dado
-        if (strcmp(msg.topic, topic_name) == 0) {
-            found_messages = 1; // se encontraron mensajes
-            printf("Usuario: %s, Mensaje: %s\n", msg.username, msg.message);  // imprimir información del mensaje
+    while (trace_read(file, &timestamp, &kind, &msg)) {
+        // Respetar los tiempos de llegada originales escalados por la velocidad
+        if (speed > 0) {
+            uint64_t due = (uint64_t)(timestamp / speed);
+            struct timespec wake = start;
+            wake.tv_sec += due / 1000000000ULL;
+            wake.tv_nsec += due % 1000000000ULL;
+            if (wake.tv_nsec >= 1000000000L) {
+                wake.tv_sec++;
+                wake.tv_nsec -= 1000000000L;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
         }
-    }
 
-    fclose(file);  // Cerrar el archivo
+        // Una pasada del lifetime por cada segundo de la traza transcurrido, como haría su hilo
+        while (timestamp >= next_tick) {
+            pthread_mutex_lock(&mutex);
+            lifetime_tick();
+            pthread_mutex_unlock(&mutex);
+            next_tick += 1000000000ULL;
+        }
 
-    if (!found_messages) {
-        printf("No hay mensajes en el tópico '%s'.\n", topic_name);
-    }
-}
+        // Los cambios de estado se aplican sin medirlos
+        if (kind != TRACE_CLIENT && kind != TRACE_ADMIN) {
+            apply_record(kind, &msg);
+            continue;
+        }
+        if (kind == TRACE_ADMIN && strcmp(msg.message, "close") == 0) {
+            continue; // el cierre termina la reproducción por sí solo
+        }
 
+        int type;
+        if (kind == TRACE_ADMIN) {
+            type = MAX_COMMAND_TYPES - 1;
+        } else {
+            type = msg.command_type >= 0 && msg.command_type < MAX_COMMAND_TYPES - 1 ? msg.command_type : MAX_COMMAND_TYPES - 2;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        apply_record(kind, &msg);
+        clock_gettime(CLOCK_MONOTONIC, &after);
 
-// Función para manejar el CTRL+C del cliente
-void handle_ctrlc(const char *username) {
-    for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].username, username) == 0) {
-            // Enviar la señal SIGTERM al proceso del cliente para finalizar su proceso
-            if (clients[i].pid > 0) {
-                kill(clients[i].pid, SIGINT);
-                printf("Se envió SIGINT a %s (PID: %d)\n", username, clients[i].pid);
-            }
-            // Desplazar elementos hacia atrás para eliminar al cliente
-            for (int j = i; j < client_count - 1; j++) {
-                clients[j] = clients[j + 1];
-            }
-            client_count--; // reducir el contador de clientes
-            printf("Cliente '%s' ha sido eliminado de la lista de conectados.\n", username);
-            return;
+        if (counts[type] == capacities[type]) {
+            capacities[type] = capacities[type] ? capacities[type] * 2 : 256;
+            latencies[type] = realloc(latencies[type], capacities[type] * sizeof(uint64_t));
         }
+        latencies[type][counts[type]++] = (after.tv_sec - before.tv_sec) * 1000000000ULL + (after.tv_nsec - before.tv_nsec);
+        total++;
     }
-    printf("Cliente '%s' no encontrado.\n", username);
-}
-
-// Función para bloquear el envío de mensajes en un topico
-void lock_topic(const char *topic_name) {
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].name, topic_name) == 0) {
-            if (!topics[i].is_locked) {
-                topics[i].is_locked = 1; // bloquear el tópico
-                printf("Tópico '%s' bloqueado.\n", topic_name);
+    fclose(file);
 
-                // Notificar a los suscriptores del bloqueo
-                char notification[256];
-                snprintf(notification, sizeof(notification), "El tópico '%s' ha sido bloqueado. No se pueden enviar mensajes temporalmente.", topic_name);
-                for (int j = 0; j < topics[i].subscriber_count; j++) {
-                    for (int k = 0; k < client_count; k++) {
-                        if (strcmp(clients[k].username, topics[i].subscribers[j]) == 0) {
-                            send_response(clients[k].client_pipe, notification);
-                            break;
-                        }
-                    }
-                }
-            } else {
-                printf("El tópico '%s' ya está bloqueado.\n", topic_name);
-            }
-            return;
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    double elapsed = (after.tv_sec - start.tv_sec) + (after.tv_nsec - start.tv_nsec) / 1e9;
+    printf("\nReproducidos %zu comandos en %.3f s (%.0f comandos/s)\n", total, elapsed, elapsed > 0 ? total / elapsed : 0.0);
+    printf("%-12s %8s %12s %12s %12s %12s\n", "comando", "número", "media (ns)", "p50 (ns)", "p99 (ns)", "máx (ns)");
+    for (int type = 0; type < MAX_COMMAND_TYPES; type++) {
+        if (counts[type] == 0) {
+            continue;
+        }
+        qsort(latencies[type], counts[type], sizeof(uint64_t), compare_latency);
+        uint64_t sum = 0;
+        for (size_t i = 0; i < counts[type]; i++) {
+            sum += latencies[type][i];
         }
+        printf("%-12s %8zu %12llu %12llu %12llu %12llu\n", command_name(type), counts[type],
+               (unsigned long long)(sum / counts[type]),
+               (unsigned long long)latencies[type][counts[type] / 2],
+               (unsigned long long)latencies[type][(counts[type] * 99) / 100],
+               (unsigned long long)latencies[type][counts[type] - 1]);
+        free(latencies[type]);
     }
-    printf("No se encontró el tópico '%s' para bloquear.\n", topic_name);
+    print_delivery_stats();
 }
 
-// Función para bloquear el envío de mensajes en un topico
-void unlock_topic(const char* topic_name) {
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].name, topic_name) == 0) {
-            if (topics[i].is_locked) {
-                topics[i].is_locked = 0;  // desbloquear el tópico
-                printf("El tópico '%s' ha sido desbloqueado para el envío de mensajes.\n", topic_name);
+// Función para esperar y leer comandos de la pipe del servidor con poll: devuelve los bytes leídos,
+// 0 si no hay comandos y hay entregas pendientes, o -1 si hay que volver a intentarlo
+ssize_t poll_ingest_read(int server_fd, char *buf, size_t size, long wait_us) {
+    struct pollfd pfd = { .fd = server_fd, .events = POLLIN };
+    ingest_syscalls++;
+    int ready = poll(&pfd, 1, wait_us < 0 ? -1 : (int)((wait_us + 999) / 1000));
+    if (ready == -1) {
+        if (errno != EINTR) {
+            perror("Error al esperar comandos de los clientes");
+        }
+        return -1;
+    }
+    if (ready == 0) {
+        return 0;
+    }
 
-                // Notificar a los suscriptores del desbloqueo
-                char notification[256];
-                snprintf(notification, sizeof(notification), "El tópico '%s' ha sido desbloqueado. Ya puedes enviar mensajes.", topic_name);
-                for (int j = 0; j < topics[i].subscriber_count; j++) {
-                    for (int k = 0; k < client_count; k++) {
-                        if (strcmp(clients[k].username, topics[i].subscribers[j]) == 0) {
-                            send_response(clients[k].client_pipe, notification);
-                            break;
-                        }
-                    }
-                }
-            } else {
-                printf("El tópico '%s' ya está desbloqueado.\n", topic_name);
-            }
-            return;
+    // Leer las solicitudes de los clientes (varias por llamada si están disponibles)
+    ingest_syscalls++;
+    ssize_t bytesRead = read(server_fd, buf, size);
+    if (bytesRead <= 0) {
+        if (bytesRead < 0 && errno != EINTR && errno != EAGAIN) {
+            perror("Error al leer el mensaje del cliente");
         }
+        return -1;
     }
-    printf("Error: Tópico '%s' no encontrado.\n", topic_name);
+    return bytesRead;
 }
 
+// Función para devolver al núcleo un buffer registrado de la pipe del servidor
+void ingest_buffer_return(int bid) {
+    struct io_uring_buf *buf = &ingest_buffer_ring->bufs[ingest_buffer_tail & (INGEST_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ingest_pool + (size_t)bid * INGEST_BUFFER_SIZE);
+    buf->len = INGEST_BUFFER_SIZE;
+    buf->bid = bid;
+    ingest_buffer_tail++;
+    __atomic_store_n(&ingest_buffer_ring->tail, ingest_buffer_tail, __ATOMIC_RELEASE);
+}
 
-// Función para manejar el envío de comandos del manager
-void* command_sender(void* arg) {
-    struct sigaction sa;
-    sa.sa_handler = thread_signal_handler; // registrar el manejador de señales
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGUSR1, &sa, NULL);  // asignar el manejador para SIGUSR1
+// Función para pedir la lectura de la pipe del servidor: multishot (una sola petición sirve para todas
+// las lecturas siguientes) o de una sola vez si el núcleo no la admite
+void ingest_arm(int server_fd) {
+    struct io_uring_sqe *sqe = uring_sqe(&ingest_ring);
+    sqe->opcode = ingest_multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+    sqe->fd = server_fd;
+    sqe->flags = IOSQE_BUFFER_SELECT; // el núcleo elige un buffer libre del grupo
+    sqe->buf_group = INGEST_GROUP;
+    sqe->len = ingest_multishot ? 0 : INGEST_BUFFER_SIZE;
+    sqe->off = (uint64_t)-1; // las pipes no tienen posición
+    ingest_syscalls++;
+    uring_submit(&ingest_ring, 0);
+}
 
-    char input[256];
-    while (!terminate_thread) {     
-        if (fgets(input, sizeof(input), stdin) == NULL) {
-            if (terminate_thread){
-                printf("Recibida señal de terminación\n");
-                break; 
-            }  
-            continue;
-        }
-        input[strcspn(input, "\n")] = 0; // eliminar salto de línea para que se pueda procesar bien el comando
+// Función para preparar la lectura de la pipe del servidor con io_uring y un grupo de buffers registrados
+int uring_ingest_start(int server_fd) {
+    if (uring_setup(&ingest_ring, 8) == -1) {
+        return -1;
+    }
+    ingest_buffer_ring = mmap(NULL, INGEST_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ingest_pool = malloc((size_t)INGEST_BUFFERS * INGEST_BUFFER_SIZE);
 
-        // Comando remove <user>
-        if (strncmp(input, "remove ", 7) == 0) {
-            char username[USERNAME_LEN];
-            sscanf(input + 7, "%s", username);
-            pthread_mutex_lock(&mutex);
-            remove_client(username); // Eliminar cliente
-            pthread_mutex_unlock(&mutex);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ingest_buffer_ring;
+    reg.ring_entries = INGEST_BUFFERS;
+    reg.bgid = INGEST_GROUP;
+    if (ingest_buffer_ring == MAP_FAILED || ingest_pool == NULL ||
+        syscall(__NR_io_uring_register, ingest_ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        if (ingest_buffer_ring != MAP_FAILED) {
+            munmap(ingest_buffer_ring, INGEST_BUFFERS * sizeof(struct io_uring_buf));
         }
-        // Comando close
-        else if (strcmp(input, "close") == 0) {
-            close_all_connections(); 
-            unlink(SERVER_PIPE); 
-            exit(0); 
-        }
-        // Comando users
-        else if (strcmp(input, "users") == 0) {
-            pthread_mutex_lock(&mutex);
-            printf("Lista de usuarios conectados:\n");
-            list_connected_users();
-            pthread_mutex_unlock(&mutex);
+        free(ingest_pool);
+        uring_close(&ingest_ring);
+        return -1;
+    }
+
+    for (int b = 0; b < INGEST_BUFFERS; b++) {
+        ingest_buffer_return(b);
+    }
+    ingest_arm(server_fd);
+    printf("Recepción de comandos con io_uring (%d buffers registrados de %zu bytes).\n", INGEST_BUFFERS, INGEST_BUFFER_SIZE);
+    return 0;
+}
+
+// Función para recibir comandos con io_uring: devuelve los bytes copiados a buf (como mucho INGEST_BUFFER_SIZE),
+// 0 si no hay comandos y hay entregas pendientes, o -1 si hay que volver a intentarlo. Mientras llegan
+// comandos las lecturas terminadas se recogen de la cola de finalizaciones sin llamar al sistema
+ssize_t uring_ingest_read(int server_fd, char *buf, long wait_us) {
+    struct io_uring_cqe *cqe = uring_peek(&ingest_ring);
+    if (cqe == NULL) {
+        if (wait_us == 0) {
+            return 0;
         }
-        // Comando topics
-        else if (strcmp(input, "topics") == 0) {
-            pthread_mutex_lock(&mutex);
-            printf("Tópicos:\n");
-            if (topic_count == 0) {
-                printf("No se encontraron tópicos para listar.\n");
+        ingest_syscalls++;
+        if (uring_wait(&ingest_ring, wait_us) == -1) {
+            if (errno == ETIME) {
+                return 0; // plazo cumplido sin comandos
             }
-            else{
-                for (int i = 0; i < topic_count; i++) {
-                printf(" - %s (Suscriptores: %d)\n", topics[i].name, topics[i].subscriber_count);
-                }
+            if (errno != EINTR) {
+                perror("Error al esperar comandos de los clientes");
             }
-            pthread_mutex_unlock(&mutex);
-        }
-        // Comando lock <topic>
-        else if (strncmp(input, "lock ", 5) == 0){
-            char topic[TOPIC_NAME_LEN];
-            sscanf(input + 5, "%s", topic);
-            pthread_mutex_lock(&mutex);
-            lock_topic(topic);
-            pthread_mutex_unlock(&mutex);
-        }
-        // Comando unlock <topic>
-        else if (strncmp(input, "unlock ", 7) == 0){
-            char topic[TOPIC_NAME_LEN];
-            sscanf(input + 7, "%s", topic);
-            pthread_mutex_lock(&mutex);
-            unlock_topic(topic);
-            pthread_mutex_unlock(&mutex);
-        }
-        else {
-            printf("Comando desconocido: %s\n", input);
         }
+        return -1;
     }
-    pthread_exit(NULL); // terminar el hilo
+    int res = cqe->res;
+    unsigned flags = cqe->flags;
+    uring_seen(&ingest_ring);
+
+    ssize_t copied = -1;
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        memcpy(buf, ingest_pool + (size_t)bid * INGEST_BUFFER_SIZE, res);
+        ingest_buffer_return(bid);
+        copied = res;
+    } else if (res == -EINVAL && ingest_multishot) {
+        ingest_multishot = 0;
+        printf("Lectura multishot no disponible: se usan lecturas de una sola vez.\n");
+    } else if (res < 0 && res != -ENOBUFS && res != -EINTR && res != -EAGAIN) {
+        errno = -res;
+        perror("Error al leer el mensaje del cliente");
+    }
+
+    // La petición terminó (lectura de una sola vez, sin buffers libres o error): se vuelve a pedir
+    if (!(flags & IORING_CQE_F_MORE)) {
+        ingest_arm(server_fd);
+    }
+    return copied;
 }
 
 
-int main() {
+#ifndef MANAGER_NO_MAIN // bench.c incluye este archivo con su propio main
+int main(int argc, char *argv[]) {
     Response msg;
+    parse_options(argc, argv);
     
     // Definir el nombre de la variable de ambiente y el fichero donde se guardarán los mensajes
     const char *MSG_FICH = "MSG_FICH";
     const char *file_name = "mensajes.txt";
+    char shard_file[32];
+    if (shard_count > 1) {
+        // Cada shard guarda los mensajes persistentes de sus tópicos en su propio archivo
+        snprintf(shard_file, sizeof(shard_file), "mensajes_%d.txt", shard_index);
+        file_name = shard_file;
+    }
+    if (replay_path != NULL) {
+        // La reproducción empieza sin mensajes y no toca el archivo del manager real
+        file_name = "mensajes_replay.txt";
+        fclose(fopen(file_name, "w"));
+    }
     
     // Usar setenv para establecer la variable de entorno
     if (setenv(MSG_FICH, file_name, 1) != 0) {
@@ -787,144 +4826,182 @@ int main() {
         return 1;
     }
     // Cargar los mensajes del fichero del manager anterior
-    load_messages();
+    init_names();
+    init_sessions();
+    index_clients();
+    if (!standby_mode) {
+        load_messages(); // el manager en espera recibe los mensajes persistentes del principal
+    }
 
     // Configurar el manejador de señal para SIGINT
     signal(SIGINT, handle_sigint);
     // Configurar el manejador de señal para SIGUSR1
     signal(SIGUSR1, thread_signal_handler);
+    // Ignorar SIGPIPE: escribir en la pipe de un cliente muerto devuelve EPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    // El manager en espera mantiene abierta la pipe del servidor del principal: si este muere,
+    // los comandos que no llegó a leer siguen en la pipe para quien tome el relevo
+    int server_fd = -1;
+    if (standby_mode && access(server_pipe_path, F_OK) == 0) {
+        server_fd = open(server_pipe_path, O_RDWR);
+    }
 
     // Comprobar que solo hay un manager en ejecución
-    if (access(SERVER_PIPE, F_OK) == 0){
+    if (!replay_mode && access(server_pipe_path, F_OK) == 0){
         printf("YA HAY UN SERVIDOR EN EJECUCIÓN\n");
         exit(1);
     }
 
-    // Crear la pipe del servidor
-    mkfifo(SERVER_PIPE, 0600);
+    if (!replay_mode) {
+        // Borrar las pipes de clientes que murieron en una ejecución anterior
+        remove_stale_pipes();
+
+        // Crear la pipe del servidor
+        mkfifo(server_pipe_path, 0600);
+    }
+
+    // Empezar a grabar los comandos si se pidió una traza y a replicar si hay un manager en espera
+    if ((trace_path != NULL && trace_open(trace_path) == -1) || (repl_path != NULL && repl_open(repl_path) == -1)) {
+        unlink(server_pipe_path);
+        return 1;
+    }
+    trace_retained_messages();
 
     // Inicializar el mutex
     pthread_mutex_init(&mutex, NULL); 
 
+    // Con --io uring las entregas se envían en bloque; si el núcleo no lo permite se sigue con poll
+    if (io_backend == IO_URING && uring_setup(&delivery_ring, URING_ENTRIES) == -1) {
+        perror("Error al crear el anillo de io_uring, se usa poll");
+        io_backend = IO_POLL;
+    } else if (io_backend == IO_URING && uring_probe_nowait(&delivery_ring) == -1) {
+        printf("El núcleo no admite escrituras sin espera en pipes con io_uring: las entregas usan writev.\n");
+        uring_close(&delivery_ring);
+    }
+
+    // Iniciar el hilo de persistencia antes que los hilos que le envían registros
+    persist_queue_init(&persist_queue);
+    sem_init(&persist_sem, 0, 0);
+    if (pthread_create(&persist_thread, NULL, persist_writer, NULL) != 0) {
+        perror("Error al crear el hilo de persistencia");
+        return 1;
+    }
+
+    start_fanout_workers();
+
+    // En la reproducción no hay administrador ni clientes reales: se despacha la traza y se termina.
+    // El lifetime avanza con los tiempos de la traza, no con el reloj, para que sea determinista
+    if (replay_path != NULL) {
+        replay_trace(replay_path, replay_speed);
+        stop_fanout_workers();
+        persist_shutdown = 1;
+        sem_post(&persist_sem);
+        pthread_join(persist_thread, NULL);
+        return 0;
+    }
+
     // Iniciar el hilo para gestionar el lifetime de los mensajes
     if (pthread_create(&lifetime_thread, NULL, manage_lifetime, NULL) != 0) {
         perror("Error al crear el hilo de gestión de lifetime");
         return 1;
     }
+    lifetime_thread_started = 1;
 
     // Crea un hilo para ejecutar los comandos ya que el hilo principal escucha los comandos del cliente
     if (pthread_create(&command_thread, NULL, command_sender, NULL) != 0) {
         perror("Error al crear el hilo de envío de comandos");
         return 1;
     }
+    command_thread_started = 1;
+
+    // El manager en espera sigue al principal y solo atiende a los clientes si toma el relevo
+    if (standby_mode) {
+        if (!standby_follow(standby_path)) {
+            close_all_connections();
+            return 0;
+        }
+        if (promote_standby(&server_fd) == -1) {
+            return 1;
+        }
+    }
 
     // Texto inicial
+    if (shard_count > 1) {
+        printf("Shard %d/%d escuchando en '%s'.\n", shard_index, shard_count, server_pipe_path);
+    }
     printf("Esperando conexiones...\n");
 
+    // Abrir la pipe del servidor una sola vez: con O_RDWR no se recibe EOF cuando ningún cliente
+    // la tiene abierta, y los comandos que llegan seguidos no se pierden entre aperturas
+    if (server_fd == -1) {
+        server_fd = open(server_pipe_path, O_RDWR);
+    }
+    if (server_fd == -1) {
+        perror("Error al abrir la pipe del servidor");
+        return 1;
+    }
+    char ingest[INGEST_BUFFER_SIZE + sizeof(Response)]; // Comandos leídos de una vez y el resto de uno incompleto
+    size_t ingest_len = 0;
+
+    if (io_backend == IO_URING && uring_ingest_start(server_fd) == -1) {
+        perror("Error al preparar io_uring para la pipe del servidor, se usa poll");
+    }
+
     while (!terminate_thread) {
-        // Esperar por un mensaje del cliente
-        int fd = open(SERVER_PIPE, O_RDONLY);
-        if (fd == -1) {
-            perror("Error al abrir la pipe del servidor");
-            continue; // Volver a intentar en el siguiente ciclo
+        // Con entregas pendientes solo se comprueba si hay más comandos, sin esperar; con clientes
+        // bloqueados se espera como mucho la latencia máxima (al menos BLOCKED_RETRY_MIN_US) para volver a intentarlo
+        pthread_mutex_lock(&mutex);
+        int blocked = retry_blocked_clients();
+        int pending = oldest_pending_us() >= 0;
+        pthread_mutex_unlock(&mutex);
+        long wait_us = pending ? 0 : blocked > 0 ? blocked_retry_us() : -1;
+
+        ssize_t bytesRead = ingest_ring.fd != -1 ? uring_ingest_read(server_fd, ingest + ingest_len, wait_us)
+                                                 : poll_ingest_read(server_fd, ingest + ingest_len, sizeof(ingest) - ingest_len, wait_us);
+        if (bytesRead == 0) {
+            // No llegan más comandos: se entrega lo pendiente sin añadir latencia en reposo
+            pthread_mutex_lock(&mutex);
+            flush_all_clients(FLUSH_IDLE);
+            pthread_mutex_unlock(&mutex);
+            continue;
         }
-        // Leer la solicitud del cliente
-        ssize_t bytesRead = read(fd, &msg, sizeof(Response));
         if (bytesRead < 0) {
-            perror("Error al leer el mensaje del cliente");
-            close(fd);
-            continue; // Volver a intentar en el siguiente ciclo
-        } else if (bytesRead == 0) {
-            close(fd); // Uso para evitar duplicar el mensaje de bienvenida
             continue; // Volver a intentar en el siguiente ciclo
         }
+        ingest_len += bytesRead;
 
-        // Se bloquea el mutex
-        pthread_mutex_lock(&mutex);
-
-        switch (msg.command_type) {
-            // Mensaje de conexión
-            case 0: 
-                char res[512];
-                if (client_count < MAX_USERS) {
-                    int duplicate_found = 0; 
-                    // Verificar si el nombre de usuario ya está en uso
-                    for (int i = 0; i < client_count; i++) {
-                        if (strcmp(clients[i].username, msg.username) == 0) {
-                            printf("ERR: Username '%s' is already in use.\n", msg.username);
-                            duplicate_found = 1;
-                            sprintf(res, "ERR: Username '%s' is already in use.\n", msg.username);
-                            send_response(msg.client_pipe, res);
-                            sleep(1);
-                            kill(msg.pid, SIGTERM); // cierra el nuevo cliente
-                        }
-                    }
-
-                    // Si no se encuentra un duplicado, agregar al nuevo cliente
-                    if (duplicate_found == 0) {
-                        if (msg.username[0] != '\0') { // verificar que el nombre no esté vacío
-                            sprintf(res, "Bienvenido, %s", msg.username);
-                            send_response(msg.client_pipe, res);
-                            add_client(msg.client_pipe, msg.username, msg.pid);
-                        } else {
-                            printf("ERR: Invalid username.\n");
-                            send_response(msg.client_pipe, "ERR: Invalid username.\n");
-                            sleep(1);
-                            kill(msg.pid, SIGTERM); 
-                        }
-                    }
-                } else {            
-                    printf("ERR: Max number of users reached (%d).\n", MAX_USERS);
-                    sprintf(res, "ERR: Max number of users reached (%d).\n", MAX_USERS);
-                    send_response(msg.client_pipe, res);
-                    sleep(1);
-                    kill(msg.pid, SIGTERM);
-                }
-            break;
-
-            // Manejo de la creación de un tópico
-            case 1: 
-                subscribe_topic(msg.topic, msg.client_pipe, msg.username);
-                break;
-
-            // Manejo de listar los topicos
-            case 2:
-                printf("Listar tópicos para el usuario '%s'.\n", msg.username);
-                list_topics(msg.client_pipe);
-                break;
+        size_t offset = 0;
+        while (ingest_len - offset >= sizeof(Response)) {
+            memcpy(&msg, ingest + offset, sizeof(Response));
+            offset += sizeof(Response);
 
-            // Manejo del comando exit del cliente
-            case 3:
-                printf("Cliente '%s' ha salido.\n", msg.username);
-                remove_client(msg.username);
-                break;
-                
-            // Manejo de la desuscripcion de un cliente en un topico
-            case 4:
-                printf("El usuario '%s'se ha desuscrito del tópico '%s'\n", msg.username, msg.topic);
-                unsubscribe_topic(msg.topic, msg.client_pipe, msg.username);
-                break;
+            // Se bloquea el mutex (también al grabarlo: el registro de replicación se reinicia con él cogido)
+            pthread_mutex_lock(&mutex);
+            if (msg.command_type == 0) {
+                // El identificador de sesión lo elige el manager: el inicio de sesión se graba con el entregado
+                msg.session = 0;
+                dispatch_command(&msg);
+                trace_record(TRACE_CLIENT, &msg);
+            } else {
+                trace_record(TRACE_CLIENT, &msg);
+                dispatch_command(&msg);
+            }
+            pthread_mutex_unlock(&mutex); // Desbloquear el mutex después de acceder a la sección crítica
+        }
+        repl_flush(); // el manager en espera recibe el lote completo de una vez
 
-            // Manejo del envío de un mensaje y almacenamiento en un archivo si es persistente
-            case 5:
-                send_message(&msg);
-                break;
+        // Conservar un comando incompleto para la siguiente lectura
+        memmove(ingest, ingest + offset, ingest_len - offset);
+        ingest_len -= offset;
 
-            // Manejo del CTRL+C del cliente
-            case 6:
-                handle_ctrlc(msg.username);
-                break;
-                
-            default:
-                // Enviar respuesta de comando no reconocido
-                int client_fd = open(msg.client_pipe, O_WRONLY);
-                write(client_fd, "Comando no reconocido.", 22);
-                close(client_fd);
-                printf("Comando no reconocido: tipo %d\n", msg.command_type);
-                break;
+        // Bajo carga se acumulan entregas, pero nunca más allá de la latencia máxima configurada
+        pthread_mutex_lock(&mutex);
+        if (oldest_pending_us() >= max_batch_latency_us) {
+            flush_all_clients(FLUSH_LATENCY);
         }
-
-        pthread_mutex_unlock(&mutex); // Desbloquear el mutex después de acceder a la sección crítica
+        pthread_mutex_unlock(&mutex);
     }
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -8,12 +8,308 @@
 #include <sys/select.h>
 #include <pthread.h>
 #include <time.h>
+#include <stdint.h>
 
 #define SERVER_PIPE "server_pipe"
-#define MAX_TOPICS 20
+#define SERVER_PIPE_FORMAT "server_pipe_%d" // Pipe del servidor de cada shard en el modo repartido
+#define MAX_SHARDS 16 // Máximo de procesos manager en el modo repartido
+#define SHARD_VNODES 64 // Nodos virtuales de cada shard en el anillo de hash consistente
+#ifndef MAX_TOPICS
+#define MAX_TOPICS 20 // se puede ampliar al compilar (-DMAX_TOPICS=...)
+#endif
 #define TOPIC_NAME_LEN 21 // espacio adicional para el caracter nulo
-#define MAX_SUBSCRIBERS 10
+#ifndef MAX_SUBSCRIBERS
+#define MAX_SUBSCRIBERS 10 // se puede ampliar al compilar (-DMAX_SUBSCRIBERS=...) para tópicos muy anchos
+#endif
 #define USERNAME_LEN 257 // espacio adicional para el caracter nulo
-#define MAX_USERS 10
+#ifndef MAX_USERS
+#define MAX_USERS 10 // se puede ampliar al compilar (-DMAX_USERS=...)
+#endif
 #define MAX_MESSAGES 100
-#define TAM_MSG 301 // espacio adicional para el caracter nulo
\ No newline at end of file
+#define TAM_MSG 301 // espacio adicional para el caracter nulo
+#define MAX_GROUPS 5 // Máximo de grupos de consumidores por tópico
+#define GROUP_NAME_LEN 21 // espacio adicional para el caracter nulo
+#define KEY_LEN 32 // Longitud máxima de la clave de un mensaje (con el caracter nulo)
+
+// Anillo de hash consistente que asigna cada tópico a un shard (compartido por manager y feed)
+typedef struct {
+    uint32_t points[MAX_SHARDS * SHARD_VNODES]; // Posiciones de los nodos virtuales, ordenadas
+    int owners[MAX_SHARDS * SHARD_VNODES]; // Shard al que pertenece cada nodo virtual
+    int count; // Nodos virtuales en el anillo (0 = un solo manager)
+} ShardRing;
+
+// Función hash de cadenas para el anillo (FNV-1a)
+static inline uint32_t shard_hash(const char *str) {
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 16777619u;
+    }
+    return hash;
+}
+
+// Función para construir el anillo de un número de shards (los nodos se insertan ordenados)
+static inline void shard_ring_init(ShardRing *ring, int shard_count) {
+    ring->count = 0;
+    if (shard_count <= 1) {
+        return;
+    }
+    for (int shard = 0; shard < shard_count; shard++) {
+        for (int v = 0; v < SHARD_VNODES; v++) {
+            char node[32];
+            snprintf(node, sizeof(node), "shard-%d-%d", shard, v);
+            uint32_t point = shard_hash(node);
+            int i = ring->count++;
+            while (i > 0 && ring->points[i - 1] > point) {
+                ring->points[i] = ring->points[i - 1];
+                ring->owners[i] = ring->owners[i - 1];
+                i--;
+            }
+            ring->points[i] = point;
+            ring->owners[i] = shard;
+        }
+    }
+}
+
+// Función para obtener el shard dueño de un tópico: el primer nodo del anillo a partir de su hash
+static inline int shard_of(const ShardRing *ring, const char *topic) {
+    if (ring->count == 0) {
+        return 0;
+    }
+    uint32_t hash = shard_hash(topic);
+    int low = 0, high = ring->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (ring->points[mid] < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return ring->owners[low == ring->count ? 0 : low];
+}
+
+// Función para obtener el nombre de la pipe del servidor de un shard
+static inline void server_pipe_name(char *buf, size_t size, int shard, int shard_count) {
+    if (shard_count <= 1) {
+        snprintf(buf, size, "%s", SERVER_PIPE);
+    } else {
+        snprintf(buf, size, SERVER_PIPE_FORMAT, shard);
+    }
+}
+
+// Compresión de los mensajes retenidos: secuencias de literales y coincidencias (formato tipo LZ4) que
+// pueden apuntar a un diccionario previo compartido por el manager y los clientes de cada tópico
+#define LZ_MIN_MATCH 4 // Longitud mínima de una coincidencia
+#define LZ_HASH_BITS 12 // Tamaño de la tabla hash de posiciones del compresor
+#define LZ_MAX_OFFSET 65535 // Distancia máxima de una coincidencia (2 bytes)
+#define LZ_DICT_SIZE 1024 // Tamaño máximo del diccionario de un tópico
+#define LZ_FRAME_MAX 32768 // Tamaño máximo de un reenvío comprimido (cabe holgado en el buffer del cliente)
+#define LZ_RAW_MAX (1024 * MAX_MESSAGES) // Tamaño máximo de un reenvío sin comprimir
+#define LZ_CAPABILITY "lz" // Texto del inicio de sesión de los clientes que aceptan reenvíos comprimidos
+// Cabeceras de los mensajes de la pipe del cliente con un diccionario y con un reenvío comprimido. El
+// tabulador no puede aparecer en el nombre de un tópico, así no se confunden con los mensajes entregados
+#define LZ_DICT_TAG "LZDICT\t"
+#define LZ_FRAME_TAG "LZ\t"
+
+// Función para leer un byte de la concatenación del diccionario y los datos
+static inline unsigned char lz_at(const char *dict, int dict_len, const char *src, int pos) {
+    return (unsigned char)(pos < dict_len ? dict[pos] : src[pos - dict_len]);
+}
+
+// Función hash de los LZ_MIN_MATCH bytes que empiezan en una posición
+static inline int lz_hash(const char *dict, int dict_len, const char *src, int pos) {
+    uint32_t seq = 0;
+    for (int i = 0; i < LZ_MIN_MATCH; i++) {
+        seq = seq << 8 | lz_at(dict, dict_len, src, pos + i);
+    }
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Función para escribir el exceso de una longitud en bytes de 255, devuelve la nueva posición o -1
+static inline int lz_put_length(char *dst, int out, int cap, int length) {
+    for (; length >= 255; length -= 255) {
+        if (out >= cap) {
+            return -1;
+        }
+        dst[out++] = (char)255;
+    }
+    if (out >= cap) {
+        return -1;
+    }
+    dst[out++] = (char)length;
+    return out;
+}
+
+// Función para escribir una secuencia: literales y, si match_len > 0, la coincidencia que los sigue
+static inline int lz_emit(char *dst, int out, int cap, const char *literals, int lit_len, int match_len, int offset) {
+    int extra = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    if (out >= cap) {
+        return -1;
+    }
+    dst[out++] = (char)((lit_len < 15 ? lit_len : 15) << 4 | (extra < 15 ? extra : 15));
+    if (lit_len >= 15 && (out = lz_put_length(dst, out, cap, lit_len - 15)) == -1) {
+        return -1;
+    }
+    if (out + lit_len > cap) {
+        return -1;
+    }
+    memcpy(dst + out, literals, lit_len);
+    out += lit_len;
+    if (match_len > 0) {
+        if (out + 2 > cap) {
+            return -1;
+        }
+        dst[out++] = (char)(offset & 0xFF);
+        dst[out++] = (char)(offset >> 8);
+        if (extra >= 15 && (out = lz_put_length(dst, out, cap, extra - 15)) == -1) {
+            return -1;
+        }
+    }
+    return out;
+}
+
+// Función para comprimir src con un diccionario previo, devuelve el tamaño comprimido o -1 si no cabe en cap
+static inline int lz_compress(const char *dict, int dict_len, const char *src, int len, char *dst, int cap) {
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) {
+        table[i] = -1;
+    }
+    int total = dict_len + len;
+    for (int pos = 0; pos + LZ_MIN_MATCH <= dict_len; pos++) {
+        table[lz_hash(dict, dict_len, src, pos)] = pos;
+    }
+
+    int out = 0, anchor = dict_len, pos = dict_len;
+    while (pos + LZ_MIN_MATCH <= total) {
+        int h = lz_hash(dict, dict_len, src, pos);
+        int candidate = table[h];
+        table[h] = pos;
+        int match = 0;
+        if (candidate >= 0 && pos - candidate <= LZ_MAX_OFFSET) {
+            while (pos + match < total && lz_at(dict, dict_len, src, candidate + match) == lz_at(dict, dict_len, src, pos + match)) {
+                match++;
+            }
+        }
+        if (match < LZ_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+        out = lz_emit(dst, out, cap, src + (anchor - dict_len), pos - anchor, match, pos - candidate);
+        if (out == -1) {
+            return -1;
+        }
+        pos += match;
+        anchor = pos;
+    }
+    return lz_emit(dst, out, cap, src + (anchor - dict_len), total - anchor, 0, 0); // últimos literales
+}
+
+// Función para leer el exceso de una longitud, devuelve la nueva posición o -1 si los datos están cortados
+static inline int lz_get_length(const char *src, int in, int len, int *length) {
+    unsigned char byte;
+    do {
+        if (in >= len) {
+            return -1;
+        }
+        byte = (unsigned char)src[in++];
+        *length += byte;
+    } while (byte == 255);
+    return in;
+}
+
+// Función para descomprimir src con el mismo diccionario, devuelve el tamaño original o -1 si no es válido
+static inline int lz_decompress(const char *dict, int dict_len, const char *src, int len, char *dst, int cap) {
+    int in = 0, out = 0;
+    while (in < len) {
+        unsigned char token = (unsigned char)src[in++];
+        int lit_len = token >> 4;
+        if (lit_len == 15 && (in = lz_get_length(src, in, len, &lit_len)) == -1) {
+            return -1;
+        }
+        if (in + lit_len > len || out + lit_len > cap) {
+            return -1;
+        }
+        memcpy(dst + out, src + in, lit_len);
+        in += lit_len;
+        out += lit_len;
+        if (in == len) {
+            break; // la última secuencia solo tiene literales
+        }
+
+        if (in + 2 > len) {
+            return -1;
+        }
+        int offset = (unsigned char)src[in] | (unsigned char)src[in + 1] << 8;
+        in += 2;
+        int match = token & 15;
+        if (match == 15 && (in = lz_get_length(src, in, len, &match)) == -1) {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out + dict_len || out + match > cap) {
+            return -1;
+        }
+        // Byte a byte: la coincidencia puede solaparse con lo que se está escribiendo
+        for (int i = 0; i < match; i++, out++) {
+            int from = out - offset;
+            dst[out] = from >= 0 ? dst[from] : dict[dict_len + from];
+        }
+    }
+    return out;
+}
+
+// Función para codificar con COBS: el resultado no contiene el byte delim (el nulo de las pipes o el
+// salto de línea del archivo) y ocupa como mucho len + len / 254 + 1 bytes. Devuelve su longitud
+static inline size_t cobs_encode(const char *src, size_t len, char *dst, unsigned char delim) {
+    size_t out = 1, code_pos = 0;
+    unsigned char code = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (src[i] == 0) {
+            dst[code_pos] = (char)(code ^ delim);
+            code_pos = out++;
+            code = 1;
+            continue;
+        }
+        dst[out++] = (char)(src[i] ^ delim);
+        if (++code == 0xFF) {
+            dst[code_pos] = (char)(code ^ delim);
+            code_pos = out++;
+            code = 1;
+        }
+    }
+    dst[code_pos] = (char)(code ^ delim);
+    return out;
+}
+
+// Función para decodificar COBS, devuelve la longitud original o -1 si no es válido o no cabe en cap
+static inline long cobs_decode(const char *src, size_t len, char *dst, size_t cap, unsigned char delim) {
+    size_t in = 0, out = 0;
+    while (in < len) {
+        unsigned char code = (unsigned char)src[in++] ^ delim;
+        if (code == 0) {
+            return -1;
+        }
+        for (int i = 1; i < code; i++) {
+            if (in >= len || out >= cap) {
+                return -1;
+            }
+            dst[out++] = (char)(src[in++] ^ delim);
+        }
+        if (code != 0xFF && in < len) {
+            if (out >= cap) {
+                return -1;
+            }
+            dst[out++] = 0;
+        }
+    }
+    return out;
+}
+
+// Función para calcular el identificador de un diccionario (FNV-1a de su contenido, nunca 0)
+static inline uint32_t lz_dictionary_id(const char *dict, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)dict[i]) * 16777619u;
+    }
+    return hash != 0 ? hash : 1;
+}